@@ -13,6 +13,12 @@
 // Versionshistorie:
 //
 //     2017-11-09 Initiale Version
+//     2026-10-16 ACK nach jeder Zeile (Flusskontrolle)
+//     2026-10-16 Protokoll 2: binäre Frames mit CRC, Baudrate aushandelbar
+//     2026-10-16 Empfang ohne String (Ringpuffer), STATS Kommando
+//     2026-10-16 LCD Bildspeicher, Ausgabe in Häppchen zwischen den Tastaturabfragen
+//     2026-10-16 READY nach dem Start, der Daemon muss nicht mehr pauschal warten
+//     2026-10-16 weitere Zeilen/Frames aus dem Ringpuffer auch ohne neue Bytes lesen
 // 
 // ////////////////////////////////////////////////////////////
 // ////////////////////////////////////////////////////////////
@@ -70,9 +76,72 @@ static int lastSeverity = LOWSEVERITY;
 // ////////////////////////////////////////////////////////////
 
 #define BAUDRATE 57600
-String serialInputString = "";
+
+// Empfang: serialEvent leert den Hardwarepuffer (64 Bytes) in
+// den Ringpuffer, daraus werden Zeilen bzw. Frames gebaut.
+// Alles statisch - kein String, kein malloc.
+
+#define RXRING_SIZE 128         // Zweierpotenz
+#define LINEMAX 48              // längste Zeile vom Daemon
+
+static byte rxRing[RXRING_SIZE];
+static byte rxHead = 0;         // hier schreibt serialEvent
+static byte rxTail = 0;         // hier liest receiveLine/receiveFrame
+
+static char serialLine[LINEMAX + 1];
+static byte serialLineLen = 0;
+static boolean serialLineDiscard = false;   // Zeile zu lang, bis zum Zeilenende verwerfen
 boolean serialStringComplete = false;
 
+// Zähler für STATS
+
+static unsigned int rxDropped = 0;      // Ringpuffer voll, Byte verworfen
+static unsigned int rxHardwareFull = 0; // Hardwarepuffer war voll - dort gehen Bytes verloren
+static unsigned int rxLongLines = 0;
+static unsigned int rxCrcErrors = 0;
+static byte rxPeak = 0;                 // höchster Füllstand des Ringpuffers
+static int lowestFreeRam = 0x7FFF;
+
+// ////////////////////////////////////////////////////////////
+// Protokoll 2 - binäre Frames, siehe pilight-console.c
+//     SYNC LAENGE OPCODE NUTZDATEN[LAENGE] CRC8
+// Der Daemon bietet es mit "PROTO 2 <baud>" an, wir antworten
+// mit derselben Zeile und schalten dann um.
+// ////////////////////////////////////////////////////////////
+
+#define PROTO_SYNC 0xA5
+#define FRAME_OVERHEAD 4
+#define FRAME_MAXPAYLOAD 32
+
+#define OP_SPAN      0x01       // Severity, x, y, Text
+#define OP_CLEAR     0x02
+#define OP_BACKLIGHT 0x03       // 0 = aus, 1 = an
+#define OP_SEVERITY  0x04       // Severity
+#define OP_KEYACK    0x05       // Sequenznummer der Tasteneingabe
+#define OP_STATS     0x06
+
+#define OP_ACK       0x81
+#define OP_NAK       0x82
+#define OP_KEY       0x83       // Sequenznummer, Tasteneingabe
+#define OP_ONLINE    0x84
+#define OP_OFFLINE   0x85
+#define OP_STATSREPLY 0x86      // die STATS Zähler, je 2 Bytes little endian
+
+#define KEY_REPEAT 300          // ms bis eine unbestätigte Eingabe wiederholt wird
+#define KEY_RETRIES 3
+#define KEYMAX 16
+
+static byte protoVersion = 1;
+static byte frameBuffer[FRAME_MAXPAYLOAD + FRAME_OVERHEAD + 1];
+static byte frameFill = 0;
+static boolean frameComplete = false;
+
+static byte keySeq = 0;
+static byte keyFrame[KEYMAX + 1];     // Sequenznummer + Eingabe
+static byte keyFrameLen = 0;          // 0 = nichts unbestätigt
+static byte keyRetries = 0;
+elapsedMillis millisSinceKey = 0;
+
 // ////////////////////////////////////////////////////////////
 // LCD Display - i2c Adresse und Layout
 // ////////////////////////////////////////////////////////////
@@ -83,6 +152,22 @@ boolean serialStringComplete = false;
 
 LiquidCrystal_I2C lcd(I2CADDRESS, LCDCOLS, LCDROWS, LCD_5x8DOTS);
 
+// Bildspeicher: lcdBuffer ist was angezeigt werden soll, lcdGlass
+// was gerade auf dem Display steht. Jedes Zeichen ist eine eigene
+// i2c Übertragung, deshalb werden pro loop() Durchlauf höchstens
+// LCD_SLICE geänderte Zeichen geschrieben - die Tastatur wird
+// dazwischen weiter abgefragt und der Empfang weiter geleert.
+
+#define LCD_SLICE 4
+#define LCDCELLS (LCDROWS * LCDCOLS)
+#define NOCURSOR 0xFF
+
+static char lcdBuffer[LCDROWS][LCDCOLS];
+static char lcdGlass[LCDROWS][LCDCOLS];
+static boolean lcdDirty = false;
+static byte lcdScan = 0;            // nächste zu prüfende Zelle
+static byte lcdCursor = NOCURSOR;   // Zelle, auf der der LCD Cursor steht
+
 // ////////////////////////////////////////////////////////////
 // Tastaturmatrix
 // ////////////////////////////////////////////////////////////
@@ -143,7 +228,8 @@ static int millisToSwitchOffBacklight = 10000;  // wie lange LCD Licht anlassen
 static bool lcdbacklight = true;  // wird analog zum LCD backlight gestzt
 static bool noEventAck = false; // Falls lange nix war - vermeiden, dass die Routine oft aufgerufen wird 
 
-String sKeyPadInput ="";
+static char keyPadInput[KEYMAX];
+static byte keyPadLen = 0;
 
 // ////////////////////////////////////////////////////////////
 // ////////////////////////////////////////////////////////////
@@ -157,14 +243,19 @@ void setup()
 
 	lcd.begin();
   lcd.backlight();
-  lcd.home ();
-  lcd.print("PILIGHT booting...");  
+  memset(lcdGlass, ' ', sizeof(lcdGlass));
+  lcdClearBuffer();
+  lcdWrite(0, 0, "PILIGHT booting...");
+  while (lcdDirty) lcdFlushSlice();
 
 // for(int j=0;j<4;j++)  EEPROM.write(j, j+49);
 // for(int j=0;j<4;j++)  password[j]=EEPROM.read(j);
 
   Serial.begin(BAUDRATE);
-  serialInputString.reserve(200);
+
+  // der Daemon wartet darauf statt einer festen Zeit nach dem Reset
+
+  Serial.print("READY\n");
   
 }
 
@@ -176,26 +267,211 @@ void setup()
 // hardware serial RX.  This routine is run between each
 // time loop() runs, so using delay inside loop can delay
 // response.  Multiple bytes of data may be available.
+// Alles Verfügbare kommt in den Ringpuffer, damit der
+// Hardwarepuffer auch bei langsamen LCD Ausgaben nicht
+// überläuft. Zeilen bzw. Frames werden nur bis zum Ende
+// gelesen, der Rest bleibt im Ring bis sie verarbeitet sind.
+// Den holt loop() - serialEvent kommt erst wieder, wenn neue
+// Bytes eintreffen.
 // ////////////////////////////////////////////////////////////
 
 
 void serialEvent() 
 {
-  while (Serial.available()) 
+  pumpSerial();
+
+  if (protoVersion == 2)
+    receiveFrame();
+  else
+    receiveLine();
+}
+
+// ////////////////////////////////////////////////////////////
+// pumpSerial
+// ////////////////////////////////////////////////////////////
+// Hardwarepuffer -> Ringpuffer
+// ////////////////////////////////////////////////////////////
+
+void pumpSerial()
+{
+  if (Serial.available() >= SERIAL_RX_BUFFER_SIZE - 1) rxHardwareFull++;
+
+  while (Serial.available())
+  {
+    byte next = (rxHead + 1) & (RXRING_SIZE - 1);
+    byte inByte = Serial.read();
+
+    if (next == rxTail)
+    {
+      rxDropped++;
+      continue;
+    }
+    rxRing[rxHead] = inByte;
+    rxHead = next;
+  }
+
+  byte fill = (rxHead - rxTail) & (RXRING_SIZE - 1);
+  if (fill > rxPeak) rxPeak = fill;
+}
+
+// ////////////////////////////////////////////////////////////
+// receiveLine
+// ////////////////////////////////////////////////////////////
+// Ringpuffer -> serialLine, bis zum Zeilenende. Eine zu lange
+// Zeile wird verworfen, aber trotzdem als (leere) Zeile
+// gemeldet, damit der Daemon sein ACK bekommt.
+// ////////////////////////////////////////////////////////////
+
+void receiveLine()
+{
+  while ( (rxTail != rxHead) && !serialStringComplete )
   {
-    // get the new byte:
-    char inChar = (char)Serial.read();
-    // add it to the inputString:
-    serialInputString += inChar;
-    // if the incoming character is a newline, set a flag
-    // so the main loop can do something about it:
-    if ( (inChar == '\n') || (inChar == '\r') )
+    char inChar = rxRing[rxTail];
+    rxTail = (rxTail + 1) & (RXRING_SIZE - 1);
+
+    if (inChar == '\r') continue;
+    if (inChar == '\n')
     {
+      if (serialLineDiscard) serialLineLen = 0;
+      serialLineDiscard = false;
+      serialLine[serialLineLen] = '\0';
       serialStringComplete = true;
     }
+    else if (serialLineLen < LINEMAX)
+      serialLine[serialLineLen++] = inChar;
+    else if (!serialLineDiscard)
+    {
+      rxLongLines++;
+      serialLineDiscard = true;
+    }
+  }
+}
+
+
+// ////////////////////////////////////////////////////////////
+// receiveFrame
+// ////////////////////////////////////////////////////////////
+// sammelt die Bytes eines Frames im statischen Puffer. Bis zum
+// Sync-Byte wird alles verworfen.
+// ////////////////////////////////////////////////////////////
+
+void receiveFrame()
+{
+  while ( (rxTail != rxHead) && !frameComplete )
+  {
+    byte inByte = rxRing[rxTail];
+    rxTail = (rxTail + 1) & (RXRING_SIZE - 1);
+
+    if ( (frameFill == 0) && (inByte != PROTO_SYNC) ) continue;
+    if ( (frameFill == 1) && (inByte > FRAME_MAXPAYLOAD) )
+    {
+      frameFill = 0;
+      continue;
+    }
+    frameBuffer[frameFill++] = inByte;
+    if ( (frameFill >= 2) && (frameFill == frameBuffer[1] + FRAME_OVERHEAD) )
+      frameComplete = true;
   }
 }
 
+// ////////////////////////////////////////////////////////////
+// crc8 / sendFrame / sendStatus
+// ////////////////////////////////////////////////////////////
+// CRC-8 mit Polynom 0x07, wie im Daemon
+// sendStatus schickt ACK, ONLINE usw. im aktuellen Protokoll
+// ////////////////////////////////////////////////////////////
+
+byte crc8(byte crc, const byte *data, byte len)
+{
+  while (len--)
+  {
+    crc ^= *data++;
+    for (byte i = 0; i < 8; i++)
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+  }
+  return crc;
+}
+
+void sendFrame(byte opcode, const byte *payload, byte len)
+{
+  byte header[3] = { PROTO_SYNC, len, opcode };
+  byte crc = crc8(crc8(0, header + 1, 2), payload, len);
+
+  Serial.write(header, 3);
+  if (len) Serial.write(payload, len);
+  Serial.write(crc);
+}
+
+void sendStatus(byte opcode, const char *text)
+{
+  if (protoVersion == 2)
+    sendFrame(opcode, NULL, 0);
+  else
+  {
+    Serial.print(text);
+    Serial.print("\n");
+  }
+}
+
+// ////////////////////////////////////////////////////////////
+// lcdWrite / lcdClearBuffer
+// ////////////////////////////////////////////////////////////
+// schreiben nur in den Bildspeicher, auf das Display kommt es
+// mit lcdFlushSlice(). Text wird am Zeilenende abgeschnitten.
+// ////////////////////////////////////////////////////////////
+
+void lcdWrite(byte x, byte y, const char *text)
+{
+  while (*text && (x < LCDCOLS)) lcdBuffer[y][x++] = *text++;
+  lcdDirty = true;
+}
+
+void lcdClearBuffer()
+{
+  memset(lcdBuffer, ' ', sizeof(lcdBuffer));
+  lcdDirty = true;
+}
+
+// ////////////////////////////////////////////////////////////
+// lcdFlushSlice
+// ////////////////////////////////////////////////////////////
+// schreibt bis zu LCD_SLICE geänderte Zeichen auf das Display.
+// Die Suche macht da weiter, wo sie zuletzt aufgehört hat, so
+// kommt jede Zeile dran. setCursor nur, wenn die Zeichen nicht
+// direkt hintereinander liegen.
+// ////////////////////////////////////////////////////////////
+
+void lcdFlushSlice()
+{
+  byte written = 0;
+  byte clean = 0;       // Zellen ohne Änderung am Stück
+
+  if (!lcdDirty) return;
+
+  while ( (written < LCD_SLICE) && (clean < LCDCELLS) )
+  {
+    byte y = lcdScan / LCDCOLS;
+    byte x = lcdScan % LCDCOLS;
+
+    if (lcdBuffer[y][x] != lcdGlass[y][x])
+    {
+      if (lcdCursor != lcdScan) lcd.setCursor(x, y);
+      lcd.write(lcdBuffer[y][x]);
+      lcdGlass[y][x] = lcdBuffer[y][x];
+
+      // am Zeilenende springt der Cursor nicht in die nächste Zeile
+      lcdCursor = (x == LCDCOLS - 1) ? NOCURSOR : lcdScan + 1;
+      written++;
+      clean = 0;
+    }
+    else
+      clean++;
+
+    lcdScan = (lcdScan + 1) % LCDCELLS;
+  }
+
+  if (clean >= LCDCELLS) lcdDirty = false;
+}
 
 // ////////////////////////////////////////////////////////////
 // eventOcurred
@@ -204,7 +480,7 @@ void serialEvent()
 // -> LCD Hintergrundlicht an und Zähler zurücksetzen
 // ////////////////////////////////////////////////////////////
 
-void eventOcurred(int severity, int x, int y, String xMessage)
+void eventOcurred(int severity, int x, int y, const char *xMessage)
 {
   millisSinceEvent = 0;
 
@@ -212,7 +488,7 @@ void eventOcurred(int severity, int x, int y, String xMessage)
   
   if ((lcdbacklight == false) && (severity > LOWSEVERITY)) 
   {
-    Serial.print("ONLINE\n");
+    sendStatus(OP_ONLINE, "ONLINE");
     lcd.backlight();
     lcdbacklight=true;
   }
@@ -223,10 +499,9 @@ void eventOcurred(int severity, int x, int y, String xMessage)
 
   // Falls die Koordinaten gültig sind, Nachricht ausgeben
 
-  if ( (x>=0) && (x<LCDCOLS) && (y>=0) && (y<LCDROWS) && (xMessage.length()>0) )
+  if ( (x>=0) && (x<LCDCOLS) && (y>=0) && (y<LCDROWS) && (xMessage[0] != '\0') )
   {
-    lcd.setCursor(x,y);
-    lcd.print(xMessage); 
+    lcdWrite(x, y, xMessage);
   }
 
   // Severity aktualisieren
@@ -259,15 +534,14 @@ void nothingHappened()
   {
     lcd.noBacklight();
     lcdbacklight=false;
-    lcd.setCursor(LCDCOLS-5,LCDROWS-1);
-    lcd.print("     "); 
+    lcdWrite(LCDCOLS-5, LCDROWS-1, "     ");
   }
 
   // Event und Keypad Input zurücksetzen
   
   noEventAck = true;
-  sKeyPadInput="";
-  Serial.print("OFFLINE\n");
+  keyPadLen = 0;
+  sendStatus(OP_OFFLINE, "OFFLINE");
 }
 
 // ////////////////////////////////////////////////////////////
@@ -290,47 +564,105 @@ void reduceSeverity(int newSeverity)
 }
 
 // ////////////////////////////////////////////////////////////
-// parseSerialCommand
+// freeRam / sendStats
 // ////////////////////////////////////////////////////////////
-// Kommandos, die über die serielle Schnittstelle empfangen 
-// werden, interpretieren
+// freier Speicher zwischen Heap und Stack, und die Zähler für
+// STATS: frei, niedrigster Wert, verworfene Bytes, Hardware-
+// puffer voll, zu lange Zeilen, CRC Fehler, Ringpuffer Spitze
 // ////////////////////////////////////////////////////////////
 
-void parseSerialCommand()
+int freeRam()
 {
+  extern int __heap_start, *__brkval;
+  int v;
+  return (int) &v - (__brkval == 0 ? (int) &__heap_start : (int) __brkval);
+}
 
+void sendStats()
+{
+  unsigned int stats[7] = { (unsigned int) freeRam(), (unsigned int) lowestFreeRam, rxDropped, rxHardwareFull,
+                            rxLongLines, rxCrcErrors, rxPeak };
 
-  
-  String theCommand = serialInputString.substring(0,serialInputString.length()-1); // Line Feed am Ende der Zeile wegmachen
+  if (protoVersion == 2)
+  {
+    byte payload[14];
+    for (byte i = 0; i < 7; i++)
+    {
+      payload[2*i]   = stats[i] & 0xFF;
+      payload[2*i+1] = stats[i] >> 8;
+    }
+    sendFrame(OP_STATSREPLY, payload, sizeof(payload));
+    return;
+  }
 
-  // Variablen zurücksetzen
-  
-  serialInputString = "";
-  serialStringComplete = false;
+  Serial.print("STATS");
+  for (byte i = 0; i < 7; i++)
+  {
+    Serial.print(' ');
+    Serial.print(stats[i]);
+  }
+  Serial.print("\n");
+}
+
+// ////////////////////////////////////////////////////////////
+// parseSerialCommand
+// ////////////////////////////////////////////////////////////
+// Kommandos, die über die serielle Schnittstelle empfangen 
+// werden, interpretieren. Die Zeile wird an Ort und Stelle
+// zerlegt: das Kommando und bis zu 4 Parameter, getrennt
+// durch je ein Leerzeichen. Der letzte Parameter ist der
+// Rest der Zeile und darf selbst Leerzeichen enthalten.
+// ////////////////////////////////////////////////////////////
 
-  //theCommand.toUpperCase();
+void parseSerialCommand()
+{
+  char *theCommand = serialLine;
+  const char *CommandArray[4] = { "", "", "", "" };
+  char *p = strchr(theCommand, ' ');
+  byte i = 0;
 
-  String CommandArray[] = {"", "", "", "" };
+  if (p)
+  {
+    *p++ = '\0';
+    CommandArray[0] = p;
+    while ( (i < 3) && (p = strchr(p, ' ')) )
+    {
+      *p++ = '\0';
+      CommandArray[++i] = p;
+    }
+  }
 
   // CLEAR löscht den LCD Screen
 
-  if (theCommand == "CLEAR") lcd.clear();
+  if (strcmp(theCommand, "CLEAR") == 0) lcdClearBuffer();
 
-  // Andere Kommandos können bis zu 4 Parameter übergeben
-  // die durch Leerzeichen getrennt sind
+  // PROTO 2 <baud> - der Daemon bietet Protokoll 2 an. Die Antwort
+  // geht noch mit der alten Baudrate raus, danach wird umgeschaltet
 
-  int xPos = theCommand.indexOf(' ')+1;
-  int i = 0;
-
-  while (xPos < theCommand.length())
+  if ( (strcmp(theCommand, "PROTO") == 0) && (strcmp(CommandArray[0], "2") == 0) )
   {
-    char c = theCommand.charAt(xPos++);
-    if ( (c != ' ') || (i == 3) ) 
-      CommandArray[i] += c;
-    else
-      i++;
+    long baud = atol(CommandArray[1]);
+    if ( (baud != 115200) && (baud != 230400) ) baud = BAUDRATE;
+
+    Serial.print("PROTO 2 ");
+    Serial.print(baud);
+    Serial.print("\n");
+    Serial.flush();
+    if (baud != BAUDRATE)
+    {
+      Serial.end();
+      Serial.begin(baud);
+    }
+    protoVersion = 2;
+    serialLineLen = 0;
+    serialStringComplete = false;
+    return;
   }
 
+  // STATS schickt die Zähler zurück
+
+  if (strcmp(theCommand, "STATS") == 0) sendStats();
+
   // MESSAGE gibt eine Nachricht auf dem LCD aus und setzt die Severity
   // Parameter :
   // 0 - Severity
@@ -338,12 +670,80 @@ void parseSerialCommand()
   // 2 - y-Wert (ROW)
   // 3 - Nachricht
 
-  if (theCommand.substring(0,8) == "MESSAGE ")
-    lastSeverity = CommandArray[0].toInt();
-    eventOcurred(CommandArray[0].toInt(),CommandArray[1].toInt(),CommandArray[2].toInt(),CommandArray[3]);
+  if (strcmp(theCommand, "MESSAGE") == 0)
+  {
+    lastSeverity = atoi(CommandArray[0]);
+    eventOcurred(atoi(CommandArray[0]),atoi(CommandArray[1]),atoi(CommandArray[2]),CommandArray[3]);
+  }
+
+  // Zeile ist verarbeitet - der Daemon darf die nächste schicken
+
+  serialLineLen = 0;
+  serialStringComplete = false;
+  sendStatus(OP_ACK, "ACK");
   
 }
 
+// ////////////////////////////////////////////////////////////
+// parseFrame
+// ////////////////////////////////////////////////////////////
+// einen empfangenen Frame (Protokoll 2) ausführen. Jeder
+// gültige Frame wird mit ACK bestätigt, einer mit falscher
+// CRC mit NAK - der Daemon malt dann das Display neu.
+// ////////////////////////////////////////////////////////////
+
+void parseFrame()
+{
+  byte len = frameBuffer[1];
+  byte *payload = frameBuffer + 3;
+
+  frameFill = 0;
+  frameComplete = false;
+
+  if (crc8(0, frameBuffer + 1, len + 2) != payload[len])
+  {
+    rxCrcErrors++;
+    sendFrame(OP_NAK, NULL, 0);
+    return;
+  }
+  payload[len] = '\0';   // der Text endet dort, wo die CRC stand
+
+  switch (frameBuffer[2])
+  {
+    case OP_SPAN:
+      if (len < 3) break;
+      lastSeverity = payload[0];
+      eventOcurred(payload[0], payload[1], payload[2], (const char *) payload + 3);
+      break;
+
+    case OP_CLEAR:
+      lcdClearBuffer();
+      break;
+
+    case OP_BACKLIGHT:
+      if (len < 1) break;
+      lcdbacklight = payload[0];
+      if (lcdbacklight) lcd.backlight(); else lcd.noBacklight();
+      break;
+
+    case OP_SEVERITY:
+      if (len < 1) break;
+      lastSeverity = payload[0];
+      eventOcurred(payload[0], 0, 0, "");
+      break;
+
+    case OP_STATS:
+      sendStats();
+      break;
+
+    case OP_KEYACK:
+      if ( (len >= 1) && (keyFrameLen > 0) && (payload[0] == keyFrame[0]) ) keyFrameLen = 0;
+      break;
+  }
+
+  sendFrame(OP_ACK, NULL, 0);
+}
+
 
 // ////////////////////////////////////////////////////////////
 // sendKeyPadInput
@@ -352,9 +752,25 @@ void parseSerialCommand()
 
 void sendKeyPadInput()
 {
-  sKeyPadInput+="\n";
-  Serial.print(sKeyPadInput);
-  sKeyPadInput="";
+  // Protokoll 2: mit Sequenznummer, wird wiederholt bis der
+  // Daemon sie bestätigt
+
+  if (protoVersion == 2)
+  {
+    byte len = keyPadLen;
+    keyFrame[0] = ++keySeq;
+    memcpy(keyFrame + 1, keyPadInput, len);
+    keyFrameLen = len + 1;
+    keyRetries = 0;
+    millisSinceKey = 0;
+    sendFrame(OP_KEY, keyFrame, keyFrameLen);
+    keyPadLen = 0;
+    return;
+  }
+
+  Serial.write((const byte *) keyPadInput, keyPadLen);
+  Serial.print("\n");
+  keyPadLen = 0;
 }
 
 // ////////////////////////////////////////////////////////////
@@ -367,6 +783,11 @@ void sendKeyPadInput()
 void loop()
  {
 
+   // Speicher beobachten - der niedrigste Wert geht mit STATS raus
+
+   int ram = freeRam();
+   if (ram < lowestFreeRam) lowestFreeRam = ram;
+
    // prüfe ob Taste gedrückt
 
    char customKey = xKeyPad.getKey();
@@ -379,7 +800,7 @@ void loop()
       }
       else                      // ansonsten einen Stern unten im Eingabefeld anzeigen 
       {
-        eventOcurred(NORMALSEVERITY,sKeyPadInput.length()+LCDCOLS-5,LCDROWS-1,"*");
+        eventOcurred(NORMALSEVERITY,keyPadLen+LCDCOLS-5,LCDROWS-1,"*");
 
         // * can be used to clear input; also clear input after it has been sent
         
@@ -392,16 +813,28 @@ void loop()
           if (customKey == '#')
             sendKeyPadInput();
 
-          sKeyPadInput = "";
+          keyPadLen = 0;
         }
 
         // otherwise just add the char to the input string
       
-        else
-          sKeyPadInput += customKey;
+        else if (keyPadLen < KEYMAX - 1)
+          keyPadInput[keyPadLen++] = customKey;
       }
    }
 
+  // liegt schon die nächste Zeile bzw. der nächste Frame im
+  // Ringpuffer? Ohne das bliebe der Rest eines Pakets liegen
+  // (und der Daemon ohne ACK), bis wieder ein Byte ankommt.
+
+   if (!serialStringComplete && !frameComplete && (rxTail != rxHead))
+   {
+      if (protoVersion == 2)
+        receiveFrame();
+      else
+        receiveLine();
+   }
+
   // prüfe ob serieller Befehl vorliegt
 
    if (serialStringComplete) 
@@ -409,6 +842,26 @@ void loop()
       parseSerialCommand();
    }
 
+   if (frameComplete)
+   {
+      parseFrame();
+   }
+
+   // ein Häppchen vom Bildspeicher auf das Display
+
+   lcdFlushSlice();
+
+   // unbestätigte Tasteneingabe wiederholen
+
+   if ( (keyFrameLen > 0) && (millisSinceKey > KEY_REPEAT) )
+   {
+      if (keyRetries++ < KEY_RETRIES)
+        sendFrame(OP_KEY, keyFrame, keyFrameLen);
+      else
+        keyFrameLen = 0;
+      millisSinceKey = 0;
+   }
+
    // ggf. Zeitschalter zurücksetzen - lange nix passiert 
 
    if (millisSinceEvent > millisToSwitchOffBacklight) nothingHappened();
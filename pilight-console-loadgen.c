@@ -0,0 +1,669 @@
+// ////////////////////////////////////////////////////////////////////////////
+// ////////////////////////////////////////////////////////////////////////////
+// pilight-console-loadgen
+// ////////////////////////////////////////////////////////////////////////////
+// synthetic pilight server for scaling benchmarks of pilight-console.
+// Starts a daemon against a local TCP port and a pty, answers identify and
+// request values and then sends updates for N devices at a configurable,
+// optionally increasing, rate plus alarm trigger/reset bursts. The serial
+// side is acknowledged like the Arduino does. One CSV row is written per
+// interval so results can be compared across versions.
+// ////////////////////////////////////////////////////////////////////////////
+// ////////////////////////////////////////////////////////////////////////////
+
+
+// ////////////////////////////////////////////////////////////////////////////
+// includes
+// ////////////////////////////////////////////////////////////////////////////
+
+#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/sockios.h>
+#include <jansson.h>
+
+
+// ////////////////////////////////////////////////////////////////////////////
+// pre-compiler defines and global variables
+// ////////////////////////////////////////////////////////////////////////////
+
+#define BUFFER_SIZE 65536
+#define MAXPENDING 65536            // monitored updates waiting for output
+#define ALARM_HOLD 1000000          // us between alarm trigger and reset
+
+// a device the generator sends updates for
+
+struct device
+{
+    char name[64];
+    char valueKey[32];      // "temperature" -> type 3, everything else type 1
+    const char *states[2];  // values a state device alternates between
+    int monitored;          // configured in the console
+    int alarm;
+    int counter;            // makes every update a visible change
+};
+
+static struct device *devices;
+static int deviceCount;
+static int *alarmIndex;     // devices that are alarms
+static int alarmCount;
+
+static long long pending[MAXPENDING];  // send time of monitored updates
+static int pendingCount;
+
+static long long *latencies;    // us, current interval
+static int latencyCount;
+static int latencySize;
+
+// ////////////////////////////////////////////////////////////////////////////
+// nowMicros
+// ////////////////////////////////////////////////////////////////////////////
+// returns a monotonic timestamp in microseconds
+// ////////////////////////////////////////////////////////////////////////////
+
+long long nowMicros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// addDevice
+// ////////////////////////////////////////////////////////////////////////////
+
+struct device *addDevice(const char *name, const char *valueKey)
+{
+    struct device *dev;
+
+    if ((deviceCount & 255) == 0)
+        devices = realloc(devices, (deviceCount + 256) * sizeof(struct device));
+    dev = &devices[deviceCount++];
+    memset(dev, 0, sizeof(struct device));
+    snprintf(dev->name, sizeof(dev->name), "%s", name);
+    snprintf(dev->valueKey, sizeof(dev->valueKey), "%s", valueKey ? valueKey : "state");
+    dev->states[0] = "on";
+    dev->states[1] = "off";
+    return dev;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// readDevices
+// ////////////////////////////////////////////////////////////////////////////
+// takes the monitored devices and alarms from the console config and fills
+// up with synthetic devices until there are count of them
+// ////////////////////////////////////////////////////////////////////////////
+
+void readDevices(const char *configName, int count, int temperaturePercent)
+{
+    json_error_t error;
+    json_t *config = configName ? json_load_file(configName, 0, &error) : NULL;
+    const char *key;
+    json_t *value;
+    int i;
+
+    if (configName && !config)
+    {
+        printf("Error: %s: %s\n", configName, error.text);
+        exit(1);
+    }
+
+    json_object_foreach(json_object_get(config, "devices"), key, value)
+    {
+        struct device *dev = addDevice(key, json_string_value(json_object_get(value, "value")));
+        json_t *toggles = json_object_get(value, "toggles");
+        dev->monitored = 1;
+        if (json_array_size(toggles) == 2)
+        {
+            dev->states[0] = strdup(json_string_value(json_array_get(toggles, 0)));
+            dev->states[1] = strdup(json_string_value(json_array_get(toggles, 1)));
+        }
+    }
+
+    json_object_foreach(json_object_get(config, "alarms"), key, value)
+    {
+        struct device *dev = addDevice(key, json_string_value(json_object_get(value, "value")));
+        dev->monitored = 1;
+        dev->alarm = 1;
+        if (json_string_value(json_object_get(value, "triggervalue")))
+            dev->states[0] = strdup(json_string_value(json_object_get(value, "triggervalue")));
+        if (json_string_value(json_object_get(value, "resetvalue")))
+            dev->states[1] = strdup(json_string_value(json_object_get(value, "resetvalue")));
+        alarmIndex = realloc(alarmIndex, (alarmCount + 1) * sizeof(int));
+        alarmIndex[alarmCount++] = deviceCount - 1;
+    }
+
+    for (i = 0; deviceCount < count; i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "load%d", i);
+        addDevice(name, (rand() % 100 < temperaturePercent) ? "temperature" : "state");
+    }
+
+    if (config)
+        json_decref(config);
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// formatValues
+// ////////////////////////////////////////////////////////////////////////////
+// the values part of an update for one device
+// ////////////////////////////////////////////////////////////////////////////
+
+int formatValues(char *buffer, int size, struct device *dev, const char *state)
+{
+    if (strcmp(dev->valueKey, "temperature") == 0)
+        return snprintf(buffer, size, "{\"timestamp\":%ld,\"temperature\":%.1f,\"humidity\":50.0,\"battery\":1}",
+                        (long) time(NULL), (dev->counter % 400) / 10.0 - 10.0);
+    return snprintf(buffer, size, "{\"timestamp\":%ld,\"%s\":\"%s\"}", (long) time(NULL), dev->valueKey,
+                    state ? state : dev->states[dev->counter & 1]);
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// formatUpdate
+// ////////////////////////////////////////////////////////////////////////////
+// an update line as pilight sends it
+// ////////////////////////////////////////////////////////////////////////////
+
+int formatUpdate(char *buffer, int size, struct device *dev, const char *state)
+{
+    int len = snprintf(buffer, size, "{\"origin\":\"update\",\"type\":%d,\"devices\":[\"%s\"],\"values\":",
+                       strcmp(dev->valueKey, "temperature") ? 1 : 3, dev->name);
+    len += formatValues(buffer + len, size - len, dev, state);
+    len += snprintf(buffer + len, size - len, "}\n");
+    return len;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// sendValues
+// ////////////////////////////////////////////////////////////////////////////
+// answers request values with the current value of every device
+// ////////////////////////////////////////////////////////////////////////////
+
+int sendValues(int fd)
+{
+    int size = 128 + deviceCount * 192;
+    char *buffer = malloc(size);
+    int len, i;
+
+    len = snprintf(buffer, size, "{\"message\":\"values\",\"values\":[");
+    for (i = 0; i < deviceCount; i++)
+    {
+        len += snprintf(buffer + len, size - len, "%s{\"type\":%d,\"devices\":[\"%s\"],\"values\":", i ? "," : "",
+                        strcmp(devices[i].valueKey, "temperature") ? 1 : 3, devices[i].name);
+        len += formatValues(buffer + len, size - len, &devices[i], devices[i].alarm ? devices[i].states[1] : NULL);
+        len += snprintf(buffer + len, size - len, "}");
+    }
+    len += snprintf(buffer + len, size - len, "]}\n");
+
+    // this one is sent blocking, it is the answer the daemon waits for
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    write(fd, buffer, len);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    free(buffer);
+    return len;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// openPty / listenLocal / startDaemon
+// ////////////////////////////////////////////////////////////////////////////
+// the stand-ins for the Arduino and the pilight server, see also
+// pilight-console-replay
+// ////////////////////////////////////////////////////////////////////////////
+
+int openPty(char **slaveName)
+{
+    struct termios tty;
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if ( (master < 0) || (grantpt(master) < 0) || (unlockpt(master) < 0) )
+    {
+        printf("Error creating pty: %s\n", strerror(errno));
+        exit(1);
+    }
+    *slaveName = ptsname(master);
+    tcgetattr(master, &tty);
+    cfmakeraw(&tty);
+    tcsetattr(master, TCSANOW, &tty);
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    return master;
+}
+
+int listenLocal(int *port)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int on = 1;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(*port);
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if ( (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) || (listen(sock, 1) < 0) )
+    {
+        printf("Error opening local port: %s\n", strerror(errno));
+        exit(1);
+    }
+    getsockname(sock, (struct sockaddr *) &addr, &addrlen);
+    *port = ntohs(addr.sin_port);
+    return sock;
+}
+
+pid_t startDaemon(char *daemon, char *config, int port, char *slaveName, char **extra)
+{
+    char server[32];
+    char *args[32];
+    int n = 0;
+    pid_t pid;
+
+    snprintf(server, sizeof(server), "127.0.0.1:%d", port);
+    args[n++] = daemon;
+    args[n++] = "-F";
+    args[n++] = "-p";
+    args[n++] = server;
+    args[n++] = "-s";
+    args[n++] = slaveName;
+    if (config)
+    {
+        args[n++] = "-f";
+        args[n++] = config;
+    }
+    while (*extra && (n < 31))
+        args[n++] = *extra++;
+    args[n] = NULL;
+
+    pid = fork();
+    if (pid == 0)
+    {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, 1);
+        execv(daemon, args);
+        fprintf(stderr, "Error starting %s: %s\n", daemon, strerror(errno));
+        _exit(1);
+    }
+    return pid;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// latency bookkeeping
+// ////////////////////////////////////////////////////////////////////////////
+// every serial output completes all monitored updates sent before it
+// ////////////////////////////////////////////////////////////////////////////
+
+void outputSeen(long long now)
+{
+    int i;
+
+    for (i = 0; i < pendingCount; i++)
+    {
+        if (latencyCount == latencySize)
+        {
+            latencySize = latencySize ? 2 * latencySize : 4096;
+            latencies = realloc(latencies, latencySize * sizeof(long long));
+        }
+        latencies[latencyCount++] = now - pending[i];
+    }
+    pendingCount = 0;
+}
+
+int compareLatency(const void *a, const void *b)
+{
+    long long x = *(const long long *) a;
+    long long y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+double percentile(double p)
+{
+    if (latencyCount == 0)
+        return 0;
+    return latencies[(int) (p * (latencyCount - 1) + 0.5)] / 1000.0;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// main
+// ////////////////////////////////////////////////////////////////////////////
+// ////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char *argv[])
+{
+    char *daemon = "./pilight-console";
+    char *config = NULL;
+    char *csvName = NULL;
+    int count = 100;
+    double rate = 10;
+    double step = 0;
+    double interval = 1;
+    double duration = 10;
+    int temperaturePercent = 50;
+    double alarmsPerMinute = 0;
+    double dropsPerMinute = 0;
+    int port = 0;
+    int external = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:f:o:n:r:s:i:t:m:a:k:l:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd': daemon = optarg; break;
+            case 'f': config = optarg; break;
+            case 'o': csvName = optarg; break;
+            case 'n': count = atoi(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 's': step = atof(optarg); break;
+            case 'i': interval = atof(optarg); break;
+            case 't': duration = atof(optarg); break;
+            case 'm': temperaturePercent = atoi(optarg); break;
+            case 'a': alarmsPerMinute = atof(optarg); break;
+            case 'k': dropsPerMinute = atof(optarg); break;
+            case 'l': port = atoi(optarg); external = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [options] [-- daemon options]\n"
+                                "  -d daemon   pilight-console binary (./pilight-console)\n"
+                                "  -f config   console config, its devices and alarms are part of the load\n"
+                                "  -l port     do not start a daemon, wait for one on this port\n"
+                                "  -n count    number of devices (100)\n"
+                                "  -r rate     updates per second (10)\n"
+                                "  -s step     add this to the rate every interval (0)\n"
+                                "  -i seconds  length of one interval / CSV row (1)\n"
+                                "  -t seconds  duration of the run (10)\n"
+                                "  -m percent  share of temperature (type 3) devices (50)\n"
+                                "  -a n        alarm trigger/reset bursts per minute (0)\n"
+                                "  -k n        drop the pilight connection n times per minute, like a restart (0)\n"
+                                "  -o file     write the CSV there instead of stdout\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    srand(1);
+    readDevices(config, count, temperaturePercent);
+    signal(SIGPIPE, SIG_IGN);
+
+    FILE *csv = csvName ? fopen(csvName, "w") : stdout;
+    char *slaveName = NULL;
+    int master = external ? -1 : openPty(&slaveName);
+    int listener = listenLocal(&port);
+    pid_t pid = external ? 0 : startDaemon(daemon, config, port, slaveName, argv + optind);
+    int tcp = -1;
+
+    // a booted sketch says so, the daemon reads it once it has opened the port
+
+    if (master >= 0)
+        write(master, "READY\n", 6);
+
+    if (external)
+        fprintf(stderr, "waiting for pilight-console on port %d\n", port);
+
+    // ////////////////////////////////////////////////////////////////////////
+    // wait for the daemon to connect and register
+    // ////////////////////////////////////////////////////////////////////////
+
+    char request[BUFFER_SIZE];
+    int requestLen = 0;
+    int identified = 0;
+    char serialBuf[BUFFER_SIZE];
+    int serialLen = 0;
+
+    // per interval counters
+
+    long long start = 0, intervalStart = 0;
+    double sent = 0;
+    long sentUpdates = 0, monitoredUpdates = 0, serialLines = 0, serialBytes = 0, valueDumps = 0;
+    long long alarmSentAt = 0, alarmTriggeredAt = 0, alarmLatency = 0;
+    int alarmDevice = -1;
+    long long nextAlarm = 0;
+    long long nextDrop = 0, droppedAt = 0, reconnectLatency = 0;
+    char out[BUFFER_SIZE];
+    int outLen = 0, outPos = 0;
+
+    fprintf(csv, "time_s,target_ups,sent_ups,monitored_ups,serial_lines_s,serial_bytes_s,lat_p50_ms,lat_p99_ms,lat_max_ms,backlog_bytes,value_dumps,alarm_ms,reconnect_ms\n");
+
+    while (1)
+    {
+        struct pollfd fds[2];
+        long long now = nowMicros();
+        int i;
+
+        // ////////////////////////////////////////////////////////////
+        // generate load once the daemon is registered
+        // ////////////////////////////////////////////////////////////
+
+        if (identified && start)
+        {
+            double elapsed = (now - start) / 1000000.0;
+
+            if (elapsed >= duration)
+                break;
+
+            // pilight restarts: close the connection, the daemon has to come
+            // back by itself. Recovery is complete when it asks for the values.
+
+            if ( (dropsPerMinute > 0) && (tcp >= 0) && (now >= nextDrop) )
+            {
+                if (nextDrop)
+                {
+                    close(tcp);
+                    tcp = -1;
+                    droppedAt = now;
+                    outLen = outPos = requestLen = 0;
+                    pendingCount = 0;
+                }
+                nextDrop = now + (long long) (60000000 / dropsPerMinute);
+            }
+            if (tcp < 0)                // updates pilight would not send either
+                sent = rate * (now - intervalStart) / 1000000.0;
+
+            // alarm bursts: trigger, and reset a little later
+
+            if ( alarmCount && (alarmsPerMinute > 0) && (outPos == outLen) )
+            {
+                if ( (alarmDevice < 0) && (now >= nextAlarm) )
+                {
+                    alarmDevice = alarmIndex[rand() % alarmCount];
+                    outLen = formatUpdate(out, sizeof(out), &devices[alarmDevice], devices[alarmDevice].states[0]);
+                    outPos = 0;
+                    alarmSentAt = alarmTriggeredAt = now;
+                }
+                else if ( (alarmDevice >= 0) && (now - alarmTriggeredAt >= ALARM_HOLD) )
+                {
+                    outLen = formatUpdate(out, sizeof(out), &devices[alarmDevice], devices[alarmDevice].states[1]);
+                    outPos = 0;
+                    alarmDevice = -1;
+                    nextAlarm = now + (long long) (60000000 / alarmsPerMinute);
+                }
+            }
+
+            // as many updates as the rate asks for, batched into one write
+
+            while ( (outPos == outLen) && (sent < rate * (now - intervalStart) / 1000000.0) )
+            {
+                outLen = outPos = 0;
+                while ( (sent < rate * (now - intervalStart) / 1000000.0) && (outLen < (int) sizeof(out) - 512) )
+                {
+                    struct device *dev = &devices[rand() % deviceCount];
+                    if (dev->alarm)
+                        continue;
+                    dev->counter++;
+                    outLen += formatUpdate(out + outLen, sizeof(out) - outLen, dev, NULL);
+                    sent++;
+                    sentUpdates++;
+                    if (dev->monitored)
+                    {
+                        monitoredUpdates++;
+                        if (pendingCount < MAXPENDING)
+                            pending[pendingCount++] = now;
+                    }
+                }
+            }
+
+            if (outPos < outLen)
+            {
+                int wlen = write(tcp, out + outPos, outLen - outPos);
+                if (wlen > 0)
+                    outPos += wlen;
+            }
+
+            // ////////////////////////////////////////////////////////////
+            // one CSV row per interval
+            // ////////////////////////////////////////////////////////////
+
+            if (now - intervalStart >= interval * 1000000)
+            {
+                double secs = (now - intervalStart) / 1000000.0;
+                int backlog = 0;
+
+                ioctl(tcp, SIOCOUTQ, &backlog);
+                backlog += outLen - outPos;
+                qsort(latencies, latencyCount, sizeof(long long), compareLatency);
+                fprintf(csv, "%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.3f,%.3f,%.3f,%d,%ld,%.3f,%.3f\n",
+                        (now - start) / 1000000.0, rate, sentUpdates / secs, monitoredUpdates / secs,
+                        serialLines / secs, serialBytes / secs,
+                        percentile(0.5), percentile(0.99), percentile(1), backlog, valueDumps, alarmLatency / 1000.0,
+                        reconnectLatency / 1000.0);
+                fflush(csv);
+
+                rate += step;
+                intervalStart = now;
+                sent = 0;
+                sentUpdates = monitoredUpdates = serialLines = serialBytes = valueDumps = 0;
+                latencyCount = 0;
+                alarmLatency = 0;
+                reconnectLatency = 0;
+            }
+        }
+
+        if (pid && (waitpid(pid, NULL, WNOHANG) == pid))
+        {
+            fprintf(stderr, "Error: daemon exited\n");
+            pid = 0;
+            break;
+        }
+
+        fds[0].fd = master;
+        fds[0].events = POLLIN;
+        fds[1].fd = (tcp >= 0) ? tcp : listener;
+        fds[1].events = POLLIN | (((tcp >= 0) && (outPos < outLen)) ? POLLOUT : 0);
+
+        if (poll(fds, 2, (identified && start) ? 1 : 100) < 0)
+            continue;
+        now = nowMicros();
+
+        // ////////////////////////////////////////////////////////////
+        // requests from the daemon
+        // ////////////////////////////////////////////////////////////
+
+        if (fds[1].revents & POLLIN)
+        {
+            if (tcp < 0)
+            {
+                int on = 1;
+                tcp = accept(listener, NULL, NULL);
+                fcntl(tcp, F_SETFL, fcntl(tcp, F_GETFL) | O_NONBLOCK);
+                setsockopt(tcp, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            }
+            else
+            {
+                int rdlen = read(tcp, request + requestLen, sizeof(request) - requestLen - 1);
+                char *nl;
+
+                if (rdlen == 0)
+                {
+                    fprintf(stderr, "Error: daemon closed the connection\n");
+                    break;
+                }
+                if (rdlen > 0)
+                    requestLen += rdlen;
+                request[requestLen] = '\0';
+
+                while ((nl = strchr(request, '\n')))
+                {
+                    *nl = '\0';
+                    if (strstr(request, "\"identify\""))
+                    {
+                        write(tcp, "{\"status\":\"success\"}\n", 21);
+                        identified = 1;
+                    }
+                    else if (strstr(request, "\"request values\""))
+                    {
+                        sendValues(tcp);
+                        valueDumps++;
+                        if (droppedAt)
+                        {
+                            reconnectLatency = now - droppedAt;
+                            droppedAt = 0;
+                        }
+                        if (!start)
+                            start = intervalStart = nowMicros();
+                    }
+                    memmove(request, nl + 1, requestLen - (nl + 1 - request) + 1);
+                    requestLen -= nl + 1 - request;
+                }
+                if (requestLen == sizeof(request) - 1)
+                    requestLen = 0;
+            }
+        }
+
+        // ////////////////////////////////////////////////////////////
+        // serial output - acknowledge every line like the sketch does
+        // ////////////////////////////////////////////////////////////
+
+        if ( (master >= 0) && (fds[0].revents & POLLIN) )
+        {
+            int rdlen = read(master, serialBuf + serialLen, sizeof(serialBuf) - serialLen);
+
+            if (rdlen > 0)
+            {
+                serialLen += rdlen;
+                serialBytes += rdlen;
+                outputSeen(now);
+                for (i = 0; i < serialLen; i++)
+                {
+                    if (serialBuf[i] != '\n')
+                        continue;
+                    serialLines++;
+                    if ( alarmSentAt && (memmem(serialBuf, i, "!!!", 3) != NULL) )
+                    {
+                        alarmLatency = now - alarmSentAt;
+                        alarmSentAt = 0;
+                    }
+                    write(master, "ACK\n", 4);
+                    memmove(serialBuf, serialBuf + i + 1, serialLen - i - 1);
+                    serialLen -= i + 1;
+                    i = -1;
+                }
+                if (serialLen == sizeof(serialBuf))
+                    serialLen = 0;
+            }
+        }
+    }
+
+    if (pid > 0)
+    {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    if (csv != stdout)
+        fclose(csv);
+    return 0;
+}
@@ -0,0 +1,683 @@
+// ////////////////////////////////////////////////////////////////////////////
+// ////////////////////////////////////////////////////////////////////////////
+// pilight-console-replay
+// ////////////////////////////////////////////////////////////////////////////
+// plays a capture taken with "pilight-console -c <file>" back into a fresh
+// pilight-console. The tool stands in for the pilight server (a local TCP
+// listener) and for the Arduino (a pty that acknowledges every line), and
+// reports throughput, update to serial latency and the difference between
+// the serial output of the capture and the one of this run.
+// ////////////////////////////////////////////////////////////////////////////
+// ////////////////////////////////////////////////////////////////////////////
+
+
+// ////////////////////////////////////////////////////////////////////////////
+// includes
+// ////////////////////////////////////////////////////////////////////////////
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+
+// ////////////////////////////////////////////////////////////////////////////
+// pre-compiler defines and global variables
+// ////////////////////////////////////////////////////////////////////////////
+
+#define BUFFER_SIZE 65536
+#define CAUSAL_TIMEOUT 2000000      // us to wait for the daemon's request
+#define QUIET_TIME 500000           // us without output that ends the replay
+#define CONNECT_TIMEOUT 30000000    // us for the daemon to connect
+
+// one input event: bytes the daemon received from pilight or the Arduino
+
+struct event
+{
+    long long time;         // us since the start of the capture
+    char link;              // T = pilight, S = Arduino
+    char *data;
+    int len;
+    int updates;            // number of pilight updates in data
+    int tcpLinesBefore;     // lines the daemon had sent to pilight before
+    int serialLinesBefore;  // lines the daemon had sent to the Arduino before
+    int expectSerial;       // the capture shows serial output after it
+};
+
+static struct event *events;
+static int eventCount;
+
+static char **expectedLines;    // serial output of the capture
+static int expectedCount;
+static int framedCapture;       // the Arduino of the capture spoke protocol 2
+
+static char **actualLines;      // serial output of this run
+static int actualCount;
+
+static long long *latencies;    // us from update to serial output
+static int latencyCount;
+
+// ////////////////////////////////////////////////////////////////////////////
+// nowMicros
+// ////////////////////////////////////////////////////////////////////////////
+// returns a monotonic timestamp in microseconds
+// ////////////////////////////////////////////////////////////////////////////
+
+long long nowMicros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// appendLine
+// ////////////////////////////////////////////////////////////////////////////
+// adds a copy of a line to a growing list of lines
+// ////////////////////////////////////////////////////////////////////////////
+
+void appendLine(char ***lines, int *count, const char *line, int len)
+{
+    if ((*count & 255) == 0)
+        *lines = realloc(*lines, (*count + 256) * sizeof(char *));
+    (*lines)[*count] = malloc(len + 1);
+    memcpy((*lines)[*count], line, len);
+    (*lines)[*count][len] = '\0';
+    (*count)++;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// countUpdates
+// ////////////////////////////////////////////////////////////////////////////
+// counts the pilight update messages in a block of bytes
+// ////////////////////////////////////////////////////////////////////////////
+
+int countUpdates(const char *data, int len)
+{
+    int n = 0;
+    const char *p = data;
+    const char *end = data + len;
+    const char *needle = "\"update\"";
+    int nlen = strlen(needle);
+
+    while (p + nlen <= end)
+    {
+        const char *hit = memchr(p, '"', end - p);
+        if (!hit || (hit + nlen > end))
+            break;
+        if (memcmp(hit, needle, nlen) == 0)
+        {
+            n++;
+            p = hit + nlen;
+        }
+        else
+            p = hit + 1;
+    }
+    return n;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// readCapture
+// ////////////////////////////////////////////////////////////////////////////
+// loads a capture into the event list and the expected serial output.
+// ACK lines from the Arduino are dropped, this tool sends its own. So is the
+// answer to PROTO: this tool is an ASCII sketch, the serial output of a
+// capture made with protocol 2 can not be compared.
+// ////////////////////////////////////////////////////////////////////////////
+
+int readCapture(const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    char header[128];
+    char serialOut[BUFFER_SIZE];
+    int serialOutLen = 0;
+    char serialIn[BUFFER_SIZE];
+    int serialInLen = 0;
+    int tcpLines = 0;
+
+    if (!f)
+    {
+        printf("Error opening %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(header, sizeof(header), f))
+    {
+        long long sec, usec;
+        char direction, link;
+        int len, i;
+        char *data;
+
+        if ( (sscanf(header, "%lld.%lld %c%c %d", &sec, &usec, &direction, &link, &len) != 5) || (len < 0) )
+        {
+            printf("Error: bad record header \"%s\"\n", header);
+            fclose(f);
+            return -1;
+        }
+        data = malloc(len + 1);
+        if ( (fread(data, 1, len, f) != (size_t) len) || (fgetc(f) != '\n') )
+        {
+            printf("Error: truncated record\n");
+            free(data);
+            fclose(f);
+            return -1;
+        }
+
+        // only the first console is played back, the replayed daemon gets
+        // a config with a single serial port
+
+        if ((link != 'T') && (link != 'S'))
+        {
+            free(data);
+            continue;
+        }
+
+        if (direction == '>')
+        {
+            // output of the daemon - remember serial lines, count pilight requests
+
+            for (i = 0; i < len; i++)
+            {
+                if (link == 'T')
+                {
+                    if (data[i] == '\n')
+                        tcpLines++;
+                    continue;
+                }
+                if (data[i] == '\n')
+                {
+                    appendLine(&expectedLines, &expectedCount, serialOut, serialOutLen);
+                    serialOutLen = 0;
+                    if (eventCount > 0)
+                        events[eventCount-1].expectSerial = 1;
+                }
+                else if (serialOutLen < BUFFER_SIZE)
+                    serialOut[serialOutLen++] = data[i];
+            }
+            free(data);
+            continue;
+        }
+
+        // input of the daemon
+
+        if (link == 'S')
+        {
+            // reassemble lines and drop the acknowledgements
+
+            char *lines = malloc(serialInLen + len + 1);
+            int outLen = 0;
+            for (i = 0; i < len; i++)
+            {
+                if (serialInLen < BUFFER_SIZE)
+                    serialIn[serialInLen++] = data[i];
+                if (data[i] == '\n')
+                {
+                    if ( (serialInLen >= 8) && (memcmp(serialIn, "PROTO 2 ", 8) == 0) )
+                        framedCapture = 1;
+                    else if ( (serialInLen != 4) || (memcmp(serialIn, "ACK\n", 4) != 0) )
+                    {
+                        memcpy(lines + outLen, serialIn, serialInLen);
+                        outLen += serialInLen;
+                    }
+                    serialInLen = 0;
+                }
+            }
+            free(data);
+            data = lines;
+            len = outLen;
+            if (len == 0)
+            {
+                free(data);
+                continue;
+            }
+        }
+
+        if ((eventCount & 255) == 0)
+            events = realloc(events, (eventCount + 256) * sizeof(struct event));
+        events[eventCount].time = sec * 1000000 + usec;
+        events[eventCount].link = link;
+        events[eventCount].data = data;
+        events[eventCount].len = len;
+        events[eventCount].updates = (link == 'T') ? countUpdates(data, len) : 0;
+        events[eventCount].tcpLinesBefore = tcpLines;
+        events[eventCount].serialLinesBefore = expectedCount;
+        events[eventCount].expectSerial = 0;
+        eventCount++;
+    }
+
+    fclose(f);
+
+    if (framedCapture)
+    {
+        int i;
+        for (i = 0; i < eventCount; i++)
+            events[i].serialLinesBefore = events[i].expectSerial = 0;
+        expectedCount = 0;
+    }
+    return 0;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// openPty
+// ////////////////////////////////////////////////////////////////////////////
+// creates the pty the daemon uses as its serial port
+// ////////////////////////////////////////////////////////////////////////////
+
+int openPty(char **slaveName)
+{
+    struct termios tty;
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if ( (master < 0) || (grantpt(master) < 0) || (unlockpt(master) < 0) )
+    {
+        printf("Error creating pty: %s\n", strerror(errno));
+        exit(1);
+    }
+    *slaveName = ptsname(master);
+
+    // no echo, no line editing until the daemon sets up the port itself
+
+    tcgetattr(master, &tty);
+    cfmakeraw(&tty);
+    tcsetattr(master, TCSANOW, &tty);
+
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    return master;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// listenLocal
+// ////////////////////////////////////////////////////////////////////////////
+// opens the TCP port the daemon connects to instead of pilight
+// ////////////////////////////////////////////////////////////////////////////
+
+int listenLocal(int *port)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int on = 1;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if ( (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) || (listen(sock, 1) < 0) )
+    {
+        printf("Error opening local port: %s\n", strerror(errno));
+        exit(1);
+    }
+    getsockname(sock, (struct sockaddr *) &addr, &addrlen);
+    *port = ntohs(addr.sin_port);
+    return sock;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// startDaemon
+// ////////////////////////////////////////////////////////////////////////////
+// runs pilight-console in the foreground against our stand-ins
+// ////////////////////////////////////////////////////////////////////////////
+
+pid_t startDaemon(char *daemon, char *config, int port, char *slaveName, int verbose)
+{
+    char server[32];
+    pid_t pid;
+
+    snprintf(server, sizeof(server), "127.0.0.1:%d", port);
+
+    pid = fork();
+    if (pid == 0)
+    {
+        char *args[] = { daemon, "-F", "-p", server, "-s", slaveName, config ? "-f" : NULL, config, NULL };
+
+        if (!verbose)
+        {
+            int devnull = open("/dev/null", O_WRONLY);
+            dup2(devnull, 1);
+        }
+        execv(daemon, args);
+        printf("Error starting %s: %s\n", daemon, strerror(errno));
+        _exit(1);
+    }
+    return pid;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// writeAll
+// ////////////////////////////////////////////////////////////////////////////
+// writes a block to a (non-blocking) descriptor, waiting if necessary
+// ////////////////////////////////////////////////////////////////////////////
+
+void writeAll(int fd, const char *data, int len)
+{
+    while (len > 0)
+    {
+        int wlen = write(fd, data, len);
+        if (wlen < 0)
+        {
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+            if ( (errno != EAGAIN) && (errno != EINTR) )
+                return;
+            poll(&pfd, 1, 100);
+            continue;
+        }
+        data += wlen;
+        len -= wlen;
+    }
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// compareLatency / percentile
+// ////////////////////////////////////////////////////////////////////////////
+
+int compareLatency(const void *a, const void *b)
+{
+    long long x = *(const long long *) a;
+    long long y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+double percentile(double p)
+{
+    int i = (int) (p * (latencyCount - 1) + 0.5);
+    return latencies[i] / 1000.0;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// main
+// ////////////////////////////////////////////////////////////////////////////
+// ////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char *argv[])
+{
+    char *daemon = "./pilight-console";
+    char *config = NULL;
+    char *outputName = NULL;
+    int fast = 0;
+    int ack = 1;
+    int verbose = 0;
+    long long waitOutput = 200000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:f:o:w:xnv")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd': daemon = optarg; break;
+            case 'f': config = optarg; break;
+            case 'o': outputName = optarg; break;
+            case 'w': waitOutput = atoll(optarg) * 1000; break;
+            case 'x': fast = 1; break;
+            case 'n': ack = 0; break;
+            case 'v': verbose = 1; break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "Usage: %s [-x] [-d daemon] [-f config] [-o output] [-w ms] [-n] [-v] capturefile\n"
+                        "  -x  as fast as possible instead of real time\n"
+                        "  -w  ms to wait for serial output of an update in fast mode (200)\n"
+                        "  -o  write the serial output of this run to a file\n"
+                        "  -n  do not acknowledge serial lines\n"
+                        "  -v  show the output of the daemon\n", argv[0]);
+        exit(1);
+    }
+
+    if (readCapture(argv[optind]) < 0)
+        exit(1);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    char *slaveName;
+    int port;
+    int master = openPty(&slaveName);
+    int listener = listenLocal(&port);
+    int tcp = -1;
+    pid_t pid = startDaemon(daemon, config, port, slaveName, verbose);
+
+    char serialBuf[BUFFER_SIZE];
+    int serialLen = 0;
+    int tcpLines = 0;
+    int next = 0;
+    int updates = 0;
+    int noOutput = 0;
+    long long start = nowMicros();
+    long long firstFeed = 0;
+    long long lastFeed = 0;
+    long long lastOutput = start;
+    long long eligibleSince = 0;
+    long long awaitingSince = 0;    // an update is waiting for its serial output
+
+    while (1)
+    {
+        struct pollfd fds[3];
+        long long now = nowMicros();
+        int timeout = 100;
+        int nfds;
+
+        // ////////////////////////////////////////////////////////////
+        // feed the next input event if it is due
+        // ////////////////////////////////////////////////////////////
+
+        if (awaitingSince && (now - awaitingSince > waitOutput))
+        {
+            noOutput++;
+            awaitingSince = 0;
+        }
+
+        while ( (next < eventCount) && (tcp >= 0) )
+        {
+            struct event *ev = &events[next];
+            int due = fast ? !awaitingSince : (now - start >= ev->time);
+
+            if (!due)
+            {
+                timeout = (ev->time - (now - start)) / 1000 + 1;
+                break;
+            }
+
+            // keep cause and effect in the order of the capture: an answer
+            // waits for the request of the daemon, and in fast mode a new
+            // input waits for the serial output of the previous one
+
+            if (!eligibleSince)
+                eligibleSince = now;
+            if ( ((tcpLines < ev->tcpLinesBefore) && (now - eligibleSince < CAUSAL_TIMEOUT)) ||
+                 (fast && (actualCount < ev->serialLinesBefore) && (now - eligibleSince < waitOutput)) )
+            {
+                timeout = 1;
+                break;
+            }
+            eligibleSince = 0;
+
+            if (awaitingSince)
+                noOutput++;
+            writeAll(ev->link == 'T' ? tcp : master, ev->data, ev->len);
+            lastFeed = now;
+            if (!firstFeed && ev->updates)
+                firstFeed = now;
+            updates += ev->updates;
+            awaitingSince = (ev->updates && ev->expectSerial) ? now : 0;
+            next++;
+            if (fast && awaitingSince)
+                break;
+        }
+
+        // ////////////////////////////////////////////////////////////
+        // finished once everything is fed and the daemon has gone quiet
+        // ////////////////////////////////////////////////////////////
+
+        if ( (next == eventCount) && !awaitingSince &&
+             (now - lastOutput > QUIET_TIME) && (now - lastFeed > QUIET_TIME) )
+            break;
+
+        if ( (tcp < 0) && (now - start > CONNECT_TIMEOUT) )
+        {
+            printf("Error: daemon did not connect\n");
+            break;
+        }
+
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+        {
+            printf("Error: daemon exited\n");
+            pid = 0;
+            break;
+        }
+
+        fds[0].fd = master;
+        fds[0].events = POLLIN;
+        fds[1].fd = (tcp >= 0) ? tcp : listener;
+        fds[1].events = POLLIN;
+        nfds = 2;
+
+        if (poll(fds, nfds, timeout) < 0)
+            continue;
+        now = nowMicros();
+
+        // ////////////////////////////////////////////////////////////
+        // the daemon connects or talks to pilight
+        // ////////////////////////////////////////////////////////////
+
+        if (fds[1].revents & POLLIN)
+        {
+            if (tcp < 0)
+            {
+                int on = 1;
+                tcp = accept(listener, NULL, NULL);
+                fcntl(tcp, F_SETFL, fcntl(tcp, F_GETFL) | O_NONBLOCK);
+                setsockopt(tcp, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            }
+            else
+            {
+                char buffer[BUFFER_SIZE];
+                int i, rdlen = read(tcp, buffer, sizeof(buffer));
+                if (rdlen == 0)
+                {
+                    printf("Error: daemon closed the connection\n");
+                    break;
+                }
+                for (i = 0; i < rdlen; i++)
+                    if (buffer[i] == '\n')
+                        tcpLines++;
+            }
+        }
+
+        // ////////////////////////////////////////////////////////////
+        // serial output - acknowledge and record every line
+        // ////////////////////////////////////////////////////////////
+
+        if (fds[0].revents & POLLIN)
+        {
+            int i, rdlen = read(master, serialBuf + serialLen, sizeof(serialBuf) - serialLen);
+
+            if (rdlen > 0)
+            {
+                if (awaitingSince)
+                {
+                    if ((latencyCount & 1023) == 0)
+                        latencies = realloc(latencies, (latencyCount + 1024) * sizeof(long long));
+                    latencies[latencyCount++] = now - awaitingSince;
+                    awaitingSince = 0;
+                }
+                lastOutput = now;
+                serialLen += rdlen;
+                for (i = 0; i < serialLen; i++)
+                {
+                    if (serialBuf[i] == '\n')
+                    {
+                        appendLine(&actualLines, &actualCount, serialBuf, i);
+                        if (ack)
+                            writeAll(master, "ACK\n", 4);
+                        memmove(serialBuf, serialBuf + i + 1, serialLen - i - 1);
+                        serialLen -= i + 1;
+                        i = -1;
+                    }
+                }
+                if (serialLen == sizeof(serialBuf))
+                    serialLen = 0;
+            }
+        }
+    }
+
+    if (pid > 0)
+    {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+
+    // ////////////////////////////////////////////////////////////////////////
+    // report
+    // ////////////////////////////////////////////////////////////////////////
+
+    double elapsed = (lastFeed > firstFeed) ? (lastFeed - firstFeed) / 1000000.0 : 0;
+    int i, differ = 0, firstDiff = -1;
+
+    printf("replay: %d of %d events, %d updates in %.3f s", next, eventCount, updates, elapsed);
+    if (elapsed > 0)
+        printf(" (%.1f updates/s)", updates / elapsed);
+    printf(", %s\n", fast ? "as fast as possible" : "real time");
+
+    if (latencyCount > 0)
+    {
+        qsort(latencies, latencyCount, sizeof(long long), compareLatency);
+        printf("latency update -> serial (%d samples): min %.2f p50 %.2f p90 %.2f p99 %.2f max %.2f ms, %d without output\n",
+               latencyCount, percentile(0), percentile(0.5), percentile(0.9), percentile(0.99), percentile(1), noOutput);
+    }
+    else
+        printf("latency update -> serial: no samples, %d without output\n", noOutput);
+
+    for (i = 0; (i < expectedCount) || (i < actualCount); i++)
+    {
+        const char *e = (i < expectedCount) ? expectedLines[i] : NULL;
+        const char *a = (i < actualCount) ? actualLines[i] : NULL;
+        if (!e || !a || strcmp(e, a))
+        {
+            differ++;
+            if (firstDiff < 0)
+                firstDiff = i;
+        }
+    }
+    printf("serial output: %d lines expected, %d received, ", expectedCount, actualCount);
+    if (framedCapture)
+    {
+        printf("not compared, the capture was made with serial protocol 2\n");
+        differ = 0;
+    }
+    else if (differ == 0)
+        printf("identical\n");
+    else
+        printf("%d lines differ, first at line %d:\n  expected: %s\n  received: %s\n", differ, firstDiff + 1,
+               (firstDiff < expectedCount) ? expectedLines[firstDiff] : "(nothing)",
+               (firstDiff < actualCount) ? actualLines[firstDiff] : "(nothing)");
+
+    if (outputName)
+    {
+        FILE *f = fopen(outputName, "w");
+        if (f)
+        {
+            for (i = 0; i < actualCount; i++)
+                fprintf(f, "%s\n", actualLines[i]);
+            fclose(f);
+        }
+    }
+
+    return (differ == 0) ? 0 : 2;
+}
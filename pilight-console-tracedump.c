@@ -0,0 +1,192 @@
+// ////////////////////////////////////////////////////////////////////////////
+// ////////////////////////////////////////////////////////////////////////////
+// pilight-console-tracedump
+// ////////////////////////////////////////////////////////////////////////////
+// prints the binary trace written by "pilight-console -t <file>", oldest
+// record first. Works on the trace of a running daemon as well as on the
+// one left behind by a crash.
+// ////////////////////////////////////////////////////////////////////////////
+// ////////////////////////////////////////////////////////////////////////////
+
+
+// ////////////////////////////////////////////////////////////////////////////
+// includes
+// ////////////////////////////////////////////////////////////////////////////
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+// ////////////////////////////////////////////////////////////////////////////
+// pre-compiler defines and global variables
+// ////////////////////////////////////////////////////////////////////////////
+
+// the file format, as in pilight-console.c
+
+#define TRACE_MAGIC "PCTRACE1"
+#define TRACE_MAXNAMES 1024
+#define TRACE_NAMESIZE 32
+#define TRACE_NONE 0xffff
+
+#define TR_FRAME 9
+#define TR_TYPES 19
+
+struct traceHeader
+{
+    char magic[8];
+    uint32_t recordSize;
+    uint32_t records;
+    uint32_t nameSize;
+    uint32_t names;
+    int64_t started;
+    uint64_t written;
+    char reserved[24];
+};
+
+struct traceRecord
+{
+    uint64_t time;
+    uint8_t type;
+    char link;
+    uint16_t device;
+    uint32_t length;
+};
+
+static const char *typeNames[TR_TYPES] =
+{
+    "?", "read", "write", "line", "filtered", "parseerror", "update", "alarm", "command",
+    "frame", "key", "pin", "control", "drop", "overflow", "up", "down", "nak", "rollback"
+};
+
+// ////////////////////////////////////////////////////////////////////////////
+// main
+// ////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+    struct traceHeader *header;
+    char (*names)[TRACE_NAMESIZE];
+    struct traceRecord *ring;
+    uint64_t first, n;
+    unsigned long count[TR_TYPES][128];
+    unsigned long long bytes[TR_TYPES][128];
+    unsigned long last = 0;
+    int summary = 0;
+    struct stat st;
+    void *map;
+    int fd, opt, t, l;
+
+    while ((opt = getopt(argc, argv, "n:s")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': last = strtoul(optarg, NULL, 10); break;
+            case 's': summary = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-n last] [-s] tracefile\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, "Usage: %s [-n last] [-s] tracefile\n", argv[0]);
+        exit(1);
+    }
+
+    if (((fd = open(argv[optind], O_RDONLY)) < 0) || (fstat(fd, &st) < 0))
+    {
+        printf("Error opening %s: %s\n", argv[optind], strerror(errno));
+        exit(1);
+    }
+    if (((uint64_t) st.st_size < sizeof(struct traceHeader)) ||
+        ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED))
+    {
+        printf("Error: %s is no trace\n", argv[optind]);
+        exit(1);
+    }
+    close(fd);
+
+    header = map;
+    if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) ||
+        (header->recordSize != sizeof(struct traceRecord)) || (header->nameSize != TRACE_NAMESIZE) ||
+        ((uint64_t) st.st_size < sizeof(struct traceHeader) + TRACE_MAXNAMES * TRACE_NAMESIZE + (uint64_t) header->records * sizeof(struct traceRecord)))
+    {
+        printf("Error: %s is no trace of this version\n", argv[optind]);
+        exit(1);
+    }
+    names = (void *) (header + 1);
+    ring = (void *) (names + TRACE_MAXNAMES);
+
+    // a running daemon keeps writing, take the records as they are now
+
+    n = header->written;
+    first = (n > header->records) ? n - header->records : 0;
+    if (last && (n - first > last))
+        first = n - last;
+
+    if (!summary)
+    {
+        time_t started = header->started / 1000000;
+        char date[32];
+
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&started));
+        printf("trace started %s, %llu records written, %llu shown\n", date,
+               (unsigned long long) n, (unsigned long long) (n - first));
+    }
+
+    memset(count, 0, sizeof(count));
+    memset(bytes, 0, sizeof(bytes));
+
+    for (; first < n; first++)
+    {
+        struct traceRecord *r = &ring[first % header->records];
+        const char *type = (r->type < TR_TYPES) ? typeNames[r->type] : "?";
+
+        if (summary)
+        {
+            t = (r->type < TR_TYPES) ? r->type : 0;
+            l = r->link & 127;
+            count[t][l]++;
+            bytes[t][l] += r->length;
+            continue;
+        }
+
+        long long wall = header->started + r->time;
+        time_t sec = wall / 1000000;
+        char clock[16];
+
+        strftime(clock, sizeof(clock), "%H:%M:%S", localtime(&sec));
+        printf("%s.%06lld %10.6f %c %-10s %6u", clock, wall % 1000000, r->time / 1e6, r->link, type, r->length);
+        if (r->type == TR_FRAME)
+            printf(" op %02x", r->device);
+        else if (r->device != TRACE_NONE)
+        {
+            if (r->device < header->names)
+                printf(" %.*s", TRACE_NAMESIZE, names[r->device]);
+            else
+                printf(" device %u", r->device);
+        }
+        printf("\n");
+    }
+
+    if (summary)
+    {
+        printf("link type       records      bytes\n");
+        for (l = 0; l < 128; l++)
+            for (t = 0; t < TR_TYPES; t++)
+                if (count[t][l])
+                    printf("%c    %-10s %8lu %10llu\n", l, typeNames[t], count[t][l], bytes[t][l]);
+    }
+
+    return 0;
+}
@@ -27,6 +27,17 @@
 #include <netdb.h>
 #include <jansson.h>
 #include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <libgen.h>
+#include <pthread.h>
 
 
 // ////////////////////////////////////////////////////////////////////////////
@@ -34,11 +45,60 @@
 // ////////////////////////////////////////////////////////////////////////////
 
 #define PIDFILE "/var/run/pilight-console.pid"
+#define CONFIGFILE "/etc/pilight/pilightconsole.json"
 
-#define BUFFER_SIZE 1024
+#define ARENA_SIZE 65536          // JSON scratch memory per pilight message
+#define SERIALBUFFER_SIZE 256     // longest line from the Arduino
+#define TCPBUFFER_SIZE 262144     // longest line from pilight (the values dump)
 #define PILIGHTPORT 5000
 
-static int arduinoState;
+#define MAXTIMERS 40
+#define MAXCONSOLES 8
+#define MAXSERVERS 8
+#define PILIGHTUUID "0000-d0-63-00-101010"
+#define OUTQUEUE_SIZE 4096
+#define SERIAL_WINDOW 60        // unacknowledged bytes the Arduino can buffer
+#define MAXINFLIGHT 16          // unacknowledged lines
+#define ACK_TIMEOUT 300         // ms, fallback for sketches that do not ACK
+#define ACK_RESET 5             // ACK timeouts in a row that mean the Arduino was reset
+#define IDENTIFY_TIMEOUT 1000   // ms to wait for pilight to answer identify
+#define RECONNECT_MIN 100       // ms, first retry after a link is lost
+#define RECONNECT_MAX 5000      // ms, longest pause between retries
+#define RELOAD_DELAY 200     // ms after the last change of the config file
+#define FRAME_TICK 50        // ms between two renderings of the device lines
+#define CONTROL_TIMEOUT 3000    // ms for pilight to confirm a control action
+#define READER_QUEUE 256        // parsed pilight messages waiting for the main loop (-T)
+#define LINK_RING 4096          // bytes between a link thread and the main loop (-T), power of 2
+#define ARDUINO_BOOT 5000       // ms to wait for READY after the port is opened,
+                                // older sketches do not send it
+
+// serial protocol version 2: binary frames
+//     SYNC LENGTH OPCODE PAYLOAD[LENGTH] CRC
+// the CRC-8 (polynomial 0x07) covers LENGTH, OPCODE and PAYLOAD. It is
+// negotiated at startup with the ASCII line "PROTO 2 <baud>", a sketch that
+// knows it answers with the same line and switches to frames and the baud
+// rate, an old one answers ACK or nothing and we stay with ASCII lines.
+
+#define PROTO_TIMEOUT 1000      // ms to wait for the answer to PROTO
+#define PROTO_SYNC 0xA5
+#define FRAME_OVERHEAD 4        // sync, length, opcode, crc
+#define FRAME_MAXPAYLOAD 32
+
+#define OP_SPAN      0x01       // severity, x, y, text
+#define OP_CLEAR     0x02
+#define OP_BACKLIGHT 0x03       // 0 = off, 1 = on
+#define OP_SEVERITY  0x04       // severity
+#define OP_KEYACK    0x05       // sequence number of the key event
+#define OP_STATS     0x06       // ask for the counters of the sketch
+
+#define OP_ACK       0x81       // frame processed
+#define OP_NAK       0x82       // frame dropped (bad CRC)
+#define OP_KEY       0x83       // sequence number, keypad input
+#define OP_ONLINE    0x84
+#define OP_OFFLINE   0x85
+#define OP_STATSREPLY 0x86      // ARDUINO_STATS counters, 16 bit little endian
+#define ARDUINO_STATS 7
+
 #define ST_OFFLINE 0
 #define ST_ONLINE  1
 
@@ -49,25 +109,545 @@ static int arduinoState;
 
 #define LCDWIDTH 20
 #define LCDHEIGHT 4
+#define KEYFIELDCOL (LCDWIDTH-5)    // the sketch echoes keypad input here on the last row
+#define SPAN_OVERHEAD 15            // bytes of "MESSAGE s xx y " + newline per span
+
+#define MAXTRANSLATE 8      // translations per device
+#define VALUESIZE 30        // formatted device value
+#define KEYPADKEYS 14        // keys a device can have, * and # are clear and enter
+#define MAXPAGES 9              // pages of devices per console, chosen with 1# .. 9#
+
+// metrics, see statsFormat(). Times are sorted into log2 buckets of
+// microseconds, the last bucket takes everything above 4 s.
+
+#define HISTOGRAM_BUCKETS 24
+#define STATSBUFFER_SIZE 32768  // to start with, doubled when a scrape needs more
+#define STATS_TIMEOUT 2000      // ms a scraper gets for its request and the answer
+
+#define STAGE_READ   0          // read() of a link
+#define STAGE_PARSE  1          // filtering and parsing a pilight line
+#define STAGE_HANDLE 2          // acting on a pilight message or keypad input
+#define STAGE_QUEUE  3          // waiting in an output queue
+#define STAGE_WRITE  4          // write() of a link
+#define STAGES 5
+
+#define PATH_UPDATE  0          // pilight line read -> display command written
+#define PATH_CONTROL 1          // keypad input read -> control action written
+#define PATH_ALARM   2          // alarm read -> alarm text written to the Arduino
+#define PATH_CONFIRM 3          // control action sent -> pilight reports the new value
+#define PATHS 4
+
+// binary trace, see traceOpen(). pilight-console-tracedump.c has a copy of
+// these, keep them in sync.
+
+#define TRACE_MAGIC "PCTRACE1"
+#define TRACE_RECORDS 65536     // default ring size, 16 bytes each
+#define TRACE_MAXNAMES 1024     // device names kept in the file
+#define TRACE_NAMESIZE 32
+#define TRACE_NONE 0xffff       // record without a device
+
+#define TR_READ      1          // bytes read from a link
+#define TR_WRITE     2          // bytes written to a link
+#define TR_LINE      3          // line or frame from a link handled
+#define TR_FILTERED  4          // pilight update skipped without parsing
+#define TR_PARSEERR  5          // pilight line that is no JSON object
+#define TR_UPDATE    6          // device value from pilight, length of the value
+#define TR_ALARM     7          // alarm triggered by the device
+#define TR_COMMAND   8          // text line queued for a link
+#define TR_FRAME     9          // protocol 2 frame queued, device is the opcode
+#define TR_KEY      10          // keypad input, length of the input
+#define TR_PIN      11          // valid PIN entered
+#define TR_CONTROL  12          // control action for the device, length of the value
+#define TR_DROP     13          // output queue full, bytes dropped
+#define TR_OVERFLOW 14          // input line too long, dropped
+#define TR_UP       15          // link usable
+#define TR_DOWN     16          // link lost
+#define TR_NAK      17          // Arduino lost a frame
+#define TR_ROLLBACK 18          // control action not confirmed, old value shown again
  
 static int systemState; // Are we having an alarm?
 #define ST_ALARM 1
 #define ST_NOALARM 0
 #define ST_PINCODE_ENTERED 2
 
-static int pinValid=0;
+struct console;
+struct server;
+struct linkThreads;
+
+// input buffer per link, complete lines are handed out in place
 
-static int serfd; // the file descriptor for the serial port
-static int tcpfd; // the file descriptor for the TCP communication
-char *serialString;
-char *tcpString;
+struct lineBuffer
+{
+    struct console *console;    // NULL for pilight
+    struct server *server;      // NULL for the Arduinos
+    int fd;
+    char *data;
+    int size;
+    int head;                   // start of the first unconsumed line
+    int tail;                   // end of received data
+    int scan;                   // newline search continues here
+    int discarding;             // dropping an overlong line up to its newline
+    unsigned long overflows;
+    int framed;                 // protocol 2 frames instead of lines
+    int readyMatch;             // ... and this much of "READY\n" came in anyway
+    unsigned long crcErrors;
+    unsigned long bytesIn;
+    unsigned long linesIn;      // lines or frames
+    struct linkThreads *threads;    // -T: a serial port is read on a thread
+};
 
 json_t *globalConfig;
-json_t *globalDevices=NULL;
-json_t *globalAlarms=NULL;
-json_t *pilightStatus=NULL;
-json_t *pilightConfig=NULL;
-json_t *lastAlarm=NULL;
+
+// the devices and alarms section of the config, compiled by compileConfig()
+// into flat records so that an update costs one hash lookup
+
+struct translation
+{
+    const char *from;
+    const char *to;
+};
+
+struct device
+{
+    const char *name;
+    const char *friendlyName;
+    const char *valueKey;           // which field of "values" we show
+    int line;
+    int page;                       // 0 = the first page
+    char key;                       // keypad key toggling it, 0 = none
+    int isAlarm;                    // SV_LO for devices, SV_HI for alarms
+    const char *triggerValue;       // alarms only
+    const char *resetValue;
+    const char *toggles[2];
+    int translations;
+    struct translation translate[MAXTRANSLATE];
+    char rawValue[VALUESIZE];       // last value as received from pilight
+    char currentValue[VALUESIZE];   // last value as shown (translated)
+    int dirty;                      // changed since the last renderDevices()
+    int traceId;                    // its name in the trace file
+    int pendingId;                  // control action not confirmed yet, 0 = none
+    char pendingValue[VALUESIZE];   // ... the value it asked for
+    long long pendingAt;            // ... us, when it was sent
+};
+
+struct deviceTable
+{
+    struct device *devices;
+    int count;
+    int *hash;                      // device index by name, -1 = empty slot
+    int hashSize;                   // power of two
+    const char *pin;
+    char *pool;                     // all strings of the table
+};
+
+static struct deviceTable *deviceTable;
+static pthread_rwlock_t tableLock = PTHREAD_RWLOCK_INITIALIZER; // -T: readers filter against deviceTable
+static struct device *lastAlarm=NULL;
+
+typedef void (*timerCallback)(void *arg);
+
+struct timer
+{
+    long long deadline;         // monotonic ms, 0 = unused
+    timerCallback callback;
+    void *arg;
+};
+
+static struct timer timers[MAXTIMERS];
+
+// outbound queue per link. Commands are appended and written in batches when
+// the descriptor is writable. On the serial link at most window bytes may be
+// unacknowledged: the sketch answers every processed line (or frame) with ACK.
+
+struct outQueue
+{
+    struct console *console;    // NULL for pilight
+    int fd;
+    char data[OUTQUEUE_SIZE];
+    int head;                   // first byte not yet written
+    int tail;                   // end of queued data
+    int window;                 // 0 = no flow control
+    int inFlight;               // bytes written but not acknowledged
+    int partial;                // bytes written of the line at head
+    int partialLeft;            // ... and the bytes still missing of it
+    int lineLen[MAXINFLIGHT];   // unacknowledged lines, oldest first
+    int firstLine;
+    int lines;
+    int acked;                  // peer has sent ACKs, else one line at a time
+    int framed;                 // the "lines" are protocol 2 frames
+    unsigned long bytesOut;
+    unsigned long linesOut;
+    long long waitingSince;     // us, the data at head was queued
+    long long originAt;         // us, the input that caused it was read
+    int urgent;                 // bytes of urgent data after the unit at head
+    long long urgentAt;         // us, the input that caused them was read
+    struct linkThreads *threads;    // -T: written on a thread
+};
+
+// output that is queued while this is set goes ahead of routine output,
+// see queueData()
+
+static int urgentOutput;
+
+// one pilight daemon. With more than one, devices of a server with a "name"
+// are configured as "<name>/<device>", the devices of the server without
+// name keep their plain names.
+
+// with -T every link is read and written on threads of its own. A pilight
+// reader splits the input into lines, filters and parses them and hands them
+// to the main loop, a serial reader passes the bytes on as they are, the
+// lines and frames of the Arduino are the main loop's business. flushQueue()
+// decides what goes out as before and hands it to the writer instead of
+// calling write().
+// Every direction is a ring with exactly one producer and one consumer, so
+// head and tail are the only shared state and need no lock. A thread with
+// nothing to do sleeps in poll() on its eventfd, the other side only writes
+// to it when the sleeping flag is set. The filter looks up the device table,
+// which a reload only swaps under tableLock.
+
+struct byteRing
+{
+    char data[LINK_RING];
+    unsigned int head;              // next to take, only the consumer writes it
+    unsigned int tail;              // next to fill, only the producer writes it
+};
+
+struct linkThreads
+{
+    int fd;                         // of the connection the threads serve
+    int running;
+    pthread_t reader;
+    pthread_t writer;
+    int readerWake;                 // eventfd: room for the reader, or stop
+    int writerWake;                 // eventfd: data for the writer, or stop
+    int readerSleeping;
+    int writerSleeping;
+    int outFull;                    // the main loop waits for room in out
+    int stop;                       // the link is closed, the threads end
+    int closed;                     // the reader has seen the end of the link
+    long long readAt;               // us, the last read of the reader
+    struct byteRing in;             // serial ports: what the reader read
+    struct byteRing out;            // what the writer writes
+};
+
+struct socketMessage
+{
+    json_t *json;                   // NULL if the line is no JSON
+    int filtered;                   // dropped by isMonitoredUpdate(), json is NULL
+    char *line;                     // copy for -v and -c, else NULL
+    int length;                     // of the line, -1 = the connection is gone
+    int bytes;                      // read from the socket since the last message
+    long long readAt;               // us, when the line was complete
+    long long parseTime;            // us spent parsing it
+};
+
+struct readerQueue
+{
+    struct socketMessage slot[READER_QUEUE];
+    unsigned int head;              // next to take, only the main loop writes it
+    unsigned int tail;              // next to fill, only the reader writes it
+};
+
+struct server
+{
+    const char *name;               // namespace, NULL = plain device names
+    const char *host;
+    int port;
+    const char *uuid;
+    int fd;
+    int identified;                 // has answered identify with success
+    struct outQueue queue;
+    struct lineBuffer input;
+    int attempts;                   // failed reconnects since the last success
+    long long lostAt;               // ms, when the connection was lost
+    int valuesSeen;                 // the values have been received once
+    int resyncing;                  // values are requested again after a reconnect
+    int resyncChanged;              // ... and this many of them had changed
+    struct linkThreads *threads;    // -T: read, parsed and written on threads
+    struct readerQueue *readerQueue;
+};
+
+static struct server servers[MAXSERVERS];
+static int serverCount;
+
+// one Arduino with LCD and keypad. All consoles show the same device states
+// from the device table, each with its own layout and PIN session.
+
+struct layoutEntry
+{
+    int line;                       // -1 = not shown on this console
+    int page;
+    char key;                       // keypad key toggling it, 0 = none
+};
+
+struct console
+{
+    const char *port;
+    json_t *config;                 // its node in "consoles", NULL = top level
+    int fd;
+    int proto;                      // 1 = ASCII lines, 2 = frames
+    int protoNegotiating;           // waiting for the answer to PROTO
+    int lastKeySeq;                 // key events are repeated until acknowledged
+    int ackMisses;                  // ACK timeouts since the last ACK
+    int arduinoState;
+    int pinValid;
+    int ready;                      // port open and the sketch has booted
+    int painted;                    // the device states have been shown
+    int attempts;                   // failed reopens since the last success
+    long long lostAt;               // ms, when the port was lost
+    struct outQueue queue;
+    struct lineBuffer input;
+    char inputData[SERIALBUFFER_SIZE];
+    struct linkThreads *threads;    // -T: read and written on threads
+    struct layoutEntry *layout;     // per device of the device table
+    int keys[MAXPAGES][KEYPADKEYS]; // device index by page and keypad key, -1 = none
+    int page;                       // the page shown
+    int pageCount;
+
+    // shadow of the LCD. lcdFrame is what we want to show, lcdShadow is what
+    // the display shows right now (0 = unknown). lcdFlush() sends the
+    // difference.
+
+    char lcdFrame[LCDHEIGHT][LCDWIDTH];
+    char lcdShadow[LCDHEIGHT][LCDWIDTH];
+    int lcdCleared;                 // lcdClear() was called since the last flush
+    int lcdSeverity;                // highest severity written since the last flush
+    int lcdDirty;                   // something was written since the last flush
+};
+
+static struct console consoles[MAXCONSOLES];
+static int consoleCount;
+
+// memory accounting. Everything long-lived goes through heapAlloc/heapFree,
+// JSON parsed from pilight lives in an arena that is reset after each line.
+// The reader threads of -T parse onto the heap, the arena is the main
+// loop's alone and the heap counters are updated atomically.
+
+struct heapHeader
+{
+    size_t size;
+    size_t pad;                 // keeps the payload 16 byte aligned
+};
+
+static size_t heapLive;         // bytes currently allocated
+static size_t heapPeak;
+static unsigned long heapAllocs;
+
+static char arena[ARENA_SIZE] __attribute__((aligned(16)));
+static size_t arenaUsed;
+static size_t arenaPeak;
+static __thread int arenaActive; // jansson allocations go to the arena
+static unsigned long arenaSpills; // allocations that did not fit the arena
+
+static volatile sig_atomic_t reportRequested;
+static volatile sig_atomic_t reloadRequested;
+static int signalPipe[2] = { -1, -1 };  // the handlers wake poll() through it
+
+static char *configPath;        // for reloading
+static json_t *startupConfig;   // the links keep pointing into it
+static int inotifyFd = -1;
+
+static FILE *captureFile;       // -c: traffic of both links is logged here
+static long long captureStart;
+
+static long long startedAt;     // ms, for the time to the first screen
+static int valuesPending;       // pilight servers that have not sent the values yet
+
+static int renderPending;       // renderTick() is scheduled
+static long long lastRender;    // ms, when the device lines were last rendered
+static long long renderInputAt; // us, the first update waiting for the tick was read
+static struct lineBuffer *renderInputLink;
+
+static unsigned long updatesSeen;      // update lines from pilight
+static unsigned long updatesFiltered;  // ... dropped before JSON parsing
+static unsigned long parseErrors;      // lines from pilight that are no JSON object
+static unsigned long controlRollbacks; // control actions pilight did not confirm
+
+static int controlSeq;                 // id of the last control action
+
+// latency histograms. Only the main loop observes, also with -T where the
+// readers hand their parse times over in the message, so counting is plain
+// increments; nothing is formatted until the stats endpoint is asked.
+
+struct histogram
+{
+    unsigned long bucket[HISTOGRAM_BUCKETS];
+    unsigned long count;
+    unsigned long long sum;         // us
+};
+
+static struct histogram stageTime[STAGES];
+static struct histogram pathTime[PATHS];
+static const char *stageNames[STAGES] = { "read", "parse", "handle", "queue", "write" };
+static const char *pathNames[PATHS] = { "update_to_display", "key_to_control", "alarm_to_display", "control_to_update" };
+
+static long long inputAt;               // us, when the input being handled was read
+static struct lineBuffer *inputLink;    // ... and where it came from
+static int statsFd = -1;                // listening socket of the stats endpoint
+static int statsClient = -1;            // the scrape being served, one at a time
+
+static int verbose;                     // -v, print every line in and out
+static int threadedMode;                // -T, the links are read and written on threads
+static int mainWake = -1;               // eventfd, a link thread has something for the main loop
+
+// the trace file: a header, the device names and the ring of records
+
+struct traceHeader
+{
+    char magic[8];
+    uint32_t recordSize;
+    uint32_t records;           // size of the ring
+    uint32_t nameSize;
+    uint32_t names;             // device names that follow the header
+    int64_t started;            // wall clock in us when the trace was started
+    uint64_t written;           // records written, the ring holds the last ones
+    char reserved[24];
+};
+
+struct traceRecord
+{
+    uint64_t time;              // us since started
+    uint8_t type;               // TR_...
+    char link;                  // as in captures, T S a..g 1..7
+    uint16_t device;            // device index, or what the type says
+    uint32_t length;            // bytes
+};
+
+static struct traceHeader *traceHeader;
+static char (*traceNames)[TRACE_NAMESIZE];
+static struct traceRecord *traceRing;
+static long long traceStart;            // nowMicros() at time 0
+
+// ////////////////////////////////////////////////////////////////////////////
+// heapAlloc / heapFree
+// ////////////////////////////////////////////////////////////////////////////
+// malloc and free that keep track of the number of live bytes
+// ////////////////////////////////////////////////////////////////////////////
+
+void *heapAlloc(size_t size)
+{
+    struct heapHeader *h = malloc(sizeof(struct heapHeader) + size);
+
+    if (!h)
+        return NULL;
+    h->size = size;
+    size_t live = __atomic_add_fetch(&heapLive, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&heapAllocs, 1, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&heapPeak, __ATOMIC_RELAXED);
+
+    while ( (live > peak) &&
+            !__atomic_compare_exchange_n(&heapPeak, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+        ;
+    return h + 1;
+}
+
+void heapFree(void *ptr)
+{
+    struct heapHeader *h;
+
+    if (!ptr)
+        return;
+    h = (struct heapHeader *) ptr - 1;
+    __atomic_sub_fetch(&heapLive, h->size, __ATOMIC_RELAXED);
+    free(h);
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// jsonAlloc / jsonFree
+// ////////////////////////////////////////////////////////////////////////////
+// allocator for jansson. While a pilight message is parsed memory is taken
+// from the arena, free() on arena memory does nothing - it is all released
+// at once by arenaReset(). Messages too big for the arena spill to the heap.
+// ////////////////////////////////////////////////////////////////////////////
+
+void *jsonAlloc(size_t size)
+{
+    size_t aligned = (size + 15) & ~(size_t) 15;
+
+    if (arenaActive)
+    {
+        if (arenaUsed + aligned <= ARENA_SIZE)
+        {
+            void *ptr = arena + arenaUsed;
+            arenaUsed += aligned;
+            return ptr;
+        }
+        arenaSpills++;
+    }
+    return heapAlloc(size);
+}
+
+void jsonFree(void *ptr)
+{
+    if ( ((char *) ptr >= arena) && ((char *) ptr < arena + ARENA_SIZE) )
+        return;
+    heapFree(ptr);
+}
+
+void arenaReset()
+{
+    if (arenaUsed > arenaPeak)
+        arenaPeak = arenaUsed;
+    arenaUsed = 0;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// reportCounters
+// ////////////////////////////////////////////////////////////////////////////
+// prints the memory and filter counters and asks the Arduino for its own,
+// triggered by SIGUSR1
+// ////////////////////////////////////////////////////////////////////////////
+
+void onSigUsr1(int sig)
+{
+    int saved = errno;
+
+    reportRequested = 1;
+    write(signalPipe[1], "", 1);
+    errno = saved;
+}
+
+void sendCommand(int fd, char *theCommand);
+void sendFrame(struct console *c, int opcode, const unsigned char *payload, int len);
+
+void reportCounters()
+{
+    int i;
+
+    reportRequested = 0;
+    printf("MEMORY: heap %zu bytes live, %zu peak, %lu allocations; arena %zu of %d bytes peak, %lu spills\n",
+           __atomic_load_n(&heapLive, __ATOMIC_RELAXED), __atomic_load_n(&heapPeak, __ATOMIC_RELAXED),
+           __atomic_load_n(&heapAllocs, __ATOMIC_RELAXED), arenaPeak, ARENA_SIZE, arenaSpills);
+    printf("FILTER: %lu of %lu updates skipped without parsing\n",
+           __atomic_load_n(&updatesFiltered, __ATOMIC_RELAXED), __atomic_load_n(&updatesSeen, __ATOMIC_RELAXED));
+
+    for (i = 0; i < consoleCount; i++)
+    {
+        struct console *c = &consoles[i];
+
+        printf("SERIAL: %s protocol %d, %lu bad frames\n", c->port, c->proto, c->input.crcErrors);
+
+        // the sketch answers with an ARDUINO: line
+
+        if (c->proto == 2)
+            sendFrame(c, OP_STATS, NULL, 0);
+        else
+            sendCommand(c->fd, "STATS\n");
+    }
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// arduinoStats
+// ////////////////////////////////////////////////////////////////////////////
+// prints the counters the sketch reports on STATS
+// ////////////////////////////////////////////////////////////////////////////
+
+void arduinoStats(struct console *c, const unsigned int *stats)
+{
+    printf("ARDUINO: %s %u bytes free (lowest %u), %u bytes dropped, receive buffer full %u times, "
+           "%u lines too long, %u bad frames, ring buffer peak %u bytes\n",
+           c->port, stats[0], stats[1], stats[2], stats[3], stats[4], stats[5], stats[6]);
+}
 
 // ////////////////////////////////////////////////////////////////////////////
 // ReadFile
@@ -92,7 +672,7 @@ char* ReadFile(char *filename)
        rewind(handler);
 
        // Allocate a string that can hold it all
-       buffer = (char*) malloc(sizeof(char) * (string_size + 1) );
+       buffer = (char*) heapAlloc(sizeof(char) * (string_size + 1) );
 
        // Read it all in one operation
        read_size = fread(buffer, sizeof(char), string_size, handler);
@@ -105,7 +685,7 @@ char* ReadFile(char *filename)
        {
            // Something went wrong, throw away the memory and set
            // the buffer to NULL
-           free(buffer);
+           heapFree(buffer);
            buffer = NULL;
        }
 
@@ -142,670 +722,3796 @@ json_t *load_json(const char *text) {
 
 
 // ////////////////////////////////////////////////////////////////////////////
-// readGlobalConfig
+// hashName
 // ////////////////////////////////////////////////////////////////////////////
-// reads in the config file and stores the config in globalConfig,
-// alarms and devices
+// FNV-1a hash of a device name of the given length. hashMore() continues a
+// hash, so "<server>/<device>" can be hashed without building the string.
 // ////////////////////////////////////////////////////////////////////////////
 
-void readGlobalConfig()
+unsigned int hashMore(unsigned int h, const char *name, size_t len)
 {
-   char *configFile = NULL;
-   
-   if (configFile = ReadFile("/etc/pilight/pilightconsole.json"))
-   {
-       globalConfig = load_json(configFile);
-       if (globalConfig)
-       {
-           const char *key;
-           json_t *value;
-       
-
-           json_object_foreach(globalConfig, key, value) 
-           {
-               if (strstr(key,"devices"))
-                   globalDevices=value;
-               if (strstr(key,"alarms"))
-                   globalAlarms=value;
-           }
-            if (globalDevices)
-            {
-                json_object_foreach(globalDevices, key, value) 
-                printf("device monitored: \"%s\"\n", key);
-            }
+    while (len--)
+    {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
 
-            if (globalAlarms)
-            {
-                json_object_foreach(globalAlarms, key, value) 
-                printf("alarm monitored: \"%s\"\n", key);
-            }
-        }
-        free(configFile);
-   }
-   
+unsigned int hashName(const char *name, size_t len)
+{
+    return hashMore(2166136261u, name, len);
 }
 
 // ////////////////////////////////////////////////////////////////////////////
-// socket_connect
+// keySlot
 // ////////////////////////////////////////////////////////////////////////////
-// creates a socket on a given port and host and connects to it
-// the socket is non-blocking
+// maps a key of the 4x4 keypad to 0..KEYPADKEYS-1, -1 if it is none. The
+// sketch takes * and # for clear and enter, they never arrive as a key of
+// their own, so a device cannot have them.
 // ////////////////////////////////////////////////////////////////////////////
 
-
-int socket_connect(char *host, in_port_t port){
-	struct hostent *hp;
-	struct sockaddr_in addr;
-	int on = 1, sock;     
-
-	
-	if((hp = gethostbyname(host)) == NULL){
-		herror("gethostbyname");
-		exit(1);
-	}
-	bcopy(hp->h_addr, &addr.sin_addr, hp->h_length);
-	addr.sin_port = htons(port);
-	addr.sin_family = AF_INET;
-	sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(int));
-
-	if(sock == -1){
-		perror("setsockopt");
-		exit(1);
-	}
-	
-	if(connect(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) == -1){
-		perror("connect");
-		exit(1);
-
-	}
-	
-	// make non-blocking
-	
-	long save_fd = fcntl( sock, F_GETFL );
-	save_fd |= O_NONBLOCK;
-	fcntl( sock, F_SETFL, save_fd );
-  
-	
-	return sock;
+int keySlot(char key)
+{
+    if ((key >= '0') && (key <= '9'))
+        return key - '0';
+    if ((key >= 'A') && (key <= 'D'))
+        return key - 'A' + 10;
+    return -1;
 }
 
-
 // ////////////////////////////////////////////////////////////////////////////
-// set_interface_attribs
+// findDevice
 // ////////////////////////////////////////////////////////////////////////////
-// sets the attributes for communication on the serial port
-// from stackoverflow.com (by RicoRico, sawdust)
+// looks up a monitored device or alarm by name, name need not be terminated.
+// With a space (the name of a pilight server) the device is looked up as
+// "<space>/<name>".
 // ////////////////////////////////////////////////////////////////////////////
 
-int set_interface_attribs(int speed, int mcount)
+struct device *findDevice(struct deviceTable *table, const char *space, const char *name, size_t len)
 {
-    struct termios tty;
-
-    if (tcgetattr(serfd, &tty) < 0) {
-        printf("Error from tcgetattr: %s\n", strerror(errno));
-        return -1;
-    }
-
-    cfsetospeed(&tty, (speed_t)speed);
-    cfsetispeed(&tty, (speed_t)speed);
-
-    tty.c_cflag |= (CLOCAL | CREAD);                    /* ignore modem controls */
-    tty.c_cflag &= ~CSIZE;                              /* */
-    tty.c_cflag |= CS8;                                 /* 8-bit characters */
-    tty.c_cflag &= ~PARENB;                             /* no parity bit */
-    tty.c_cflag &= ~CSTOPB;                             /* only need 1 stop bit */
-    tty.c_cflag &= ~CRTSCTS;                            /* no hardware flowcontrol */
-    tty.c_iflag &= ~(IXON | IXOFF | IXANY);             /* No XON/XOFF */
-    tty.c_lflag &= ~(ECHO | ECHOE | ICANON | ISIG);     /* */
-    tty.c_oflag &= ~OPOST;                              /* */
-
-    /* fetch bytes as they become available */
+    size_t spaceLen = space ? strlen(space) + 1 : 0;
+    unsigned int slot;
 
-    tty.c_cc[VMIN]  = 1;
-    tty.c_cc[VTIME] = 1;
+    if (!table || !table->hashSize)
+        return NULL;
 
-    if (tcsetattr(serfd, TCSANOW, &tty) != 0) {
-        printf("Error from tcsetattr: %s\n", strerror(errno));
-        return -1;
+    slot = space ? hashMore(hashMore(hashName(space, spaceLen - 1), "/", 1), name, len) : hashName(name, len);
+    slot &= table->hashSize - 1;
+    while (table->hash[slot] >= 0)
+    {
+        struct device *dev = &table->devices[table->hash[slot]];
+        if ( (!space || ((strncmp(dev->name, space, spaceLen - 1) == 0) && (dev->name[spaceLen - 1] == '/'))) &&
+             (strncmp(dev->name + spaceLen, name, len) == 0) && (dev->name[spaceLen + len] == '\0') )
+            return dev;
+        slot = (slot + 1) & (table->hashSize - 1);
     }
+    return NULL;
+}
 
-    tty.c_cc[VMIN] =  mcount ? 1 : 0;
-    tty.c_cc[VTIME] = 5;                /* half second timer */
+// ////////////////////////////////////////////////////////////////////////////
+// deviceServer
+// ////////////////////////////////////////////////////////////////////////////
+// the pilight server a device belongs to, NULL if there is none. pilightName
+// is set to the name of the device on that server.
+// ////////////////////////////////////////////////////////////////////////////
 
-    if (tcsetattr(serfd, TCSANOW, &tty) < 0)
+struct server *deviceServer(struct device *dev, const char **pilightName)
+{
+    struct server *plain = NULL;
+    int i;
+
+    for (i = 0; i < serverCount; i++)
     {
-        printf("Error tcsetattr: %s\n", strerror(errno));
-        return -1;
+        const char *name = servers[i].name;
+
+        if (!name)
+        {
+            if (!plain)
+                plain = &servers[i];
+        }
+        else if ( (strncmp(dev->name, name, strlen(name)) == 0) && (dev->name[strlen(name)] == '/') )
+        {
+            *pilightName = dev->name + strlen(name) + 1;
+            return &servers[i];
+        }
     }
-    return 0;
+    *pilightName = dev->name;
+    return plain;
 }
 
 // ////////////////////////////////////////////////////////////////////////////
-// waitabit
+// poolString
 // ////////////////////////////////////////////////////////////////////////////
-// uses nanosleep to delay less than a second as sleep() only has seconds 
-// granularity
+// copies a string into the string pool of a device table
 // ////////////////////////////////////////////////////////////////////////////
 
-void waitabit()
+const char *poolString(char **pool, const char *string)
 {
-   struct timespec tim, tim2;
-   tim.tv_sec = 0;
-   tim.tv_nsec = 300000000;
+    char *copy = *pool;
 
-   nanosleep(&tim , &tim2);
-   
+    if (!string)
+        return NULL;
+    strcpy(copy, string);
+    *pool += strlen(string) + 1;
+    return copy;
 }
 
-
 // ////////////////////////////////////////////////////////////////////////////
-// sendCommand - send a command to Arduino or pilight
+// configPage
+// ////////////////////////////////////////////////////////////////////////////
+// the "page" of a device or layout entry, counted from 1 in the config and
+// from 0 here
 // ////////////////////////////////////////////////////////////////////////////
 
-void sendCommand (int fd, char* theCommand )
+int configPage(json_t *node)
 {
-    int wlen = write(fd, theCommand, strlen(theCommand));
-    if (wlen != strlen(theCommand)) {
-        printf("Error from write: %d, %d\n", wlen, errno);
-    }
-    
-    printf ("COMMAND %s", theCommand);
+    int page = json_integer_value(json_object_get(node,"page"));
 
-    tcdrain(fd);    /* delay for output */
-    waitabit();
+    if (page > MAXPAGES)
+    {
+        printf("page %d does not exist, the last page is %d\n", page, MAXPAGES);
+        page = MAXPAGES;
+    }
+    return (page > 0) ? page - 1 : 0;
 }
 
 // ////////////////////////////////////////////////////////////////////////////
-// pinCodeMessage - send a line asking for pincode to the arduino
+// compileDevice
 // ////////////////////////////////////////////////////////////////////////////
-// severity - the severity state
-// ClearDisplay - send a clear Command before sending pincode message
+// fills one device record from its config node
 // ////////////////////////////////////////////////////////////////////////////
 
-void pinCodeMessage(int severity,int clearDisplay)
+void compileDevice(struct device *dev, const char *name, json_t *node, int isAlarm, char **pool)
 {
-    char theLine[40];
-    bzero(theLine,40);
-    
-    if (clearDisplay==1)
+    const char *tkey;
+    json_t *tvalue;
+
+    memset(dev, 0, sizeof(struct device));
+    dev->name         = poolString(pool, name);
+    dev->isAlarm      = isAlarm;
+    dev->friendlyName = poolString(pool, json_string_value(json_object_get(node,"friendlyname")));
+    dev->valueKey     = poolString(pool, json_string_value(json_object_get(node,"value")));
+    dev->triggerValue = poolString(pool, json_string_value(json_object_get(node,"triggervalue")));
+    dev->resetValue   = poolString(pool, json_string_value(json_object_get(node,"resetvalue")));
+    dev->toggles[0]   = poolString(pool, json_string_value(json_array_get(json_object_get(node,"toggles"),0)));
+    dev->toggles[1]   = poolString(pool, json_string_value(json_array_get(json_object_get(node,"toggles"),1)));
+
+    if (!dev->friendlyName)
+        dev->friendlyName = dev->name;
+    if (!isAlarm)
     {
-        sendCommand(serfd,"CLEAR\n");
+        dev->line = json_integer_value(json_object_get(node,"line"));
+        dev->page = configPage(node);
+        if ((dev->line < 0) || (dev->line >= LCDHEIGHT-1))     // the last line is the PIN prompt
+        {
+            printf("device %s: line %d is not free for devices, not shown\n", name, dev->line);
+            dev->line = -1;
+        }
     }
-    if (pinValid)
+
+    if (json_string_value(json_object_get(node,"key")))
     {
-        sprintf (theLine,"MESSAGE %d 0 %d PIN OK    \n", severity, LCDHEIGHT-1);
+        const char *key = json_string_value(json_object_get(node,"key"));
+        if ( (strlen(key) == 1) && (keySlot(key[0]) >= 0) )
+            dev->key = key[0];
+        else
+            printf("device %s: ignoring key \"%s\", must be a single keypad key other than * and #\n", name, key);
     }
-    else
+
+    json_object_foreach(json_object_get(node,"translate"), tkey, tvalue)
     {
-        sprintf (theLine,"MESSAGE %d 0 %d PINCODE ->\n", severity, LCDHEIGHT-1);
+        if ( (dev->translations < MAXTRANSLATE) && json_is_string(tvalue) )
+        {
+            dev->translate[dev->translations].from = poolString(pool, tkey);
+            dev->translate[dev->translations].to   = poolString(pool, json_string_value(tvalue));
+            dev->translations++;
+        }
     }
-    sendCommand(serfd,theLine);
 }
 
 // ////////////////////////////////////////////////////////////////////////////
-// handleDevice
+// compileConfig
 // ////////////////////////////////////////////////////////////////////////////
-// wertet eine JSON update Nachricht aus.
+// builds the device table from the devices and alarms section of the config.
+// configSize (the length of the config text) bounds the size of all strings.
 // ////////////////////////////////////////////////////////////////////////////
 
-
-/*
-
-Example of a device section in the config file
-
-"devices":	
+struct deviceTable *compileConfig(json_t *config, size_t configSize)
 {
-	"feuerscharf"   : {"friendlyname":"Feuermelder",   "value":"state",       "translate":{"on":"scharf", "off":"aus"},"line":1},
-	"alarmscharf"   : {"friendlyname":"Alarmanlage",   "value":"state",       "translate":{"on":"scharf", "off":"aus"},"line":2},
-	"Aussensensor"  : {"friendlyname":"Aussentemp.",   "value":"temperature",                                          "line":0}
-},
+    struct deviceTable *table = heapAlloc(sizeof(struct deviceTable));
+    json_t *devices = json_object_get(config,"devices");
+    json_t *alarms = json_object_get(config,"alarms");
+    int maxDevices = json_object_size(devices) + json_object_size(alarms);
+    char *pool;
+    const char *key;
+    json_t *value;
+    int i, pass;
+
+    memset(table, 0, sizeof(struct deviceTable));
+    table->devices = heapAlloc((maxDevices ? maxDevices : 1) * sizeof(struct device));
+    table->pool = pool = heapAlloc(configSize + 1);
+
+    table->hashSize = 1;
+    while (table->hashSize < 2 * maxDevices)
+        table->hashSize <<= 1;
+    table->hash = heapAlloc(table->hashSize * sizeof(int));
+    for (i = 0; i < table->hashSize; i++)
+        table->hash[i] = -1;
+
+    table->pin = poolString(&pool, json_string_value(json_object_get(config,"pin")));
+
+    // devices first, an alarm of the same name is ignored
+
+    for (pass = 0; pass < 2; pass++)
+    {
+        json_object_foreach(pass ? alarms : devices, key, value)
+        {
+            unsigned int slot;
 
-Example update messages
+            if (findDevice(table, NULL, key, strlen(key)))
+            {
+                printf("%s \"%s\" is configured twice, ignored\n", pass ? "alarm" : "device", key);
+                continue;
+            }
+            if (!json_is_object(value))
+                continue;
 
-{"origin":"update","type":3,"devices":["Aussensensor"],"values":{"timestamp":1510915637,"temperature":6.1,"humidity":74.0,"battery":0.0}}
-{"origin":"update","type":1,"devices":["feuerscharf"],"values":{"timestamp":1510915945,"state":"on"}}
+            compileDevice(&table->devices[table->count], key, value, pass ? SV_HI : SV_LO, &pool);
 
-*/
+            slot = hashName(key, strlen(key)) & (table->hashSize - 1);
+            while (table->hash[slot] >= 0)
+                slot = (slot + 1) & (table->hashSize - 1);
+            table->hash[slot] = table->count;
 
+            printf("%s monitored: \"%s\"\n", pass ? "alarm" : "device", key);
+            table->count++;
+        }
+    }
 
-void handleDevice (json_t *updateMessage)
-{
-    // lets have a look at the device node of the incoming message
-     
-    json_t *myJson = json_object_get(updateMessage,"devices");
-    int isAlarm = 0;
-    int i;
+    return table;
+}
 
-    // the device node is an array, so we cycle through it
+// ////////////////////////////////////////////////////////////////////////////
+// readGlobalConfig
+// ////////////////////////////////////////////////////////////////////////////
+// reads in the config file and stores the config in globalConfig,
+// alarms and devices are compiled into deviceTable
+// ////////////////////////////////////////////////////////////////////////////
+
+void readGlobalConfig(char *filename)
+{
+   char *configFile = NULL;
+   
+   if ((configFile = ReadFile(filename)))
+   {
+       globalConfig = load_json(configFile);
+       if (globalConfig)
+       {
+           deviceTable = compileConfig(globalConfig, strlen(configFile));
+       }
+       heapFree(configFile);
+   }
+   
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// layoutConsole
+// ////////////////////////////////////////////////////////////////////////////
+// decides which device a console shows on which line of which page and
+// which key toggles it. Without a "layout" the console shows what devices
+// and alarms say, with one it shows only the devices listed there, e.g.
+// "layout" : { "kitchen" : { "line" : 1, "key" : "A", "page" : 2 } }
+// A key only toggles the devices of the page that is shown, so every page
+// can use the same keys.
+// ////////////////////////////////////////////////////////////////////////////
+
+void layoutConsole(struct console *c)
+{
+    json_t *layout = json_object_get(c->config, "layout");
+    const char *key;
+    json_t *value;
+    int i, p;
+
+    c->layout = heapAlloc((deviceTable->count ? deviceTable->count : 1) * sizeof(struct layoutEntry));
+    for (i = 0; i < deviceTable->count; i++)
+    {
+        c->layout[i].line = layout ? -1 : deviceTable->devices[i].line;
+        c->layout[i].page = layout ? 0 : deviceTable->devices[i].page;
+        c->layout[i].key = layout ? 0 : deviceTable->devices[i].key;
+    }
+
+    json_object_foreach(layout, key, value)
+    {
+        struct device *dev = findDevice(deviceTable, NULL, key, strlen(key));
+        const char *keyName = json_string_value(json_object_get(value, "key"));
+        int line = json_integer_value(json_object_get(value, "line"));
+
+        if (!dev || dev->isAlarm)
+        {
+            printf("layout of %s: \"%s\" is not a device, ignored\n", c->port, key);
+            continue;
+        }
+        if ((line < 0) || (line >= LCDHEIGHT-1))     // the last line is the PIN prompt
+        {
+            printf("layout of %s: line %d of \"%s\" is not free for devices, ignored\n", c->port, line, key);
+            continue;
+        }
+
+        i = dev - deviceTable->devices;
+        c->layout[i].line = line;
+        c->layout[i].page = configPage(value);
+        if (keyName && (strlen(keyName) == 1) && (keySlot(keyName[0]) >= 0))
+            c->layout[i].key = keyName[0];
+        else if (keyName)
+            printf("layout of %s: ignoring key \"%s\" of \"%s\", must be a single keypad key other than * and #\n", c->port, keyName, key);
+    }
+
+    // the keys of every page, and how many pages there are
+
+    for (p = 0; p < MAXPAGES; p++)
+        for (i = 0; i < KEYPADKEYS; i++)
+            c->keys[p][i] = -1;
+    c->pageCount = 1;
+    for (i = 0; i < deviceTable->count; i++)
+    {
+        struct layoutEntry *entry = &c->layout[i];
+
+        if (entry->key)
+            c->keys[entry->page][keySlot(entry->key)] = i;
+        if ((entry->line >= 0) && (entry->page >= c->pageCount))
+            c->pageCount = entry->page + 1;
+    }
+    if (c->page >= c->pageCount)
+        c->page = 0;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// setupConsoles
+// ////////////////////////////////////////////////////////////////////////////
+// reads the "consoles" section of the config, e.g.
+// "consoles" : [ { "port" : "/dev/ttyUSB0" }, { "port" : "/dev/ttyUSB1",
+//                  "layout" : { ... }, "protocol" : 1, "baudrate" : 115200 } ]
+// A config without it has a single console on "pinano" as before.
+// serialOption (-s) leaves only the first console, on that port.
+// ////////////////////////////////////////////////////////////////////////////
+
+void setupConsoles(const char *serialOption)
+{
+    json_t *list = json_object_get(globalConfig, "consoles");
+    size_t n = json_array_size(list);
+    int i;
+
+    consoleCount = (n && !serialOption) ? n : 1;
+    if (consoleCount > MAXCONSOLES)
+    {
+        printf("Error: only %d consoles supported, the rest is ignored\n", MAXCONSOLES);
+        consoleCount = MAXCONSOLES;
+    }
+
+    for (i = 0; i < consoleCount; i++)
+    {
+        struct console *c = &consoles[i];
+
+        c->config = n ? json_array_get(list, i) : globalConfig;
+        c->port = json_string_value(json_object_get(c->config, n ? "port" : "pinano"));
+        if (serialOption)
+            c->port = serialOption;
+        c->fd = -1;
+        c->proto = 1;
+        c->lastKeySeq = -1;
+        c->arduinoState = ST_OFFLINE;
+        c->queue.console = c;
+        c->queue.window = SERIAL_WINDOW;
+        c->input.console = c;
+        c->input.data = c->inputData;
+        c->input.size = SERIALBUFFER_SIZE;
+        if (c->port)
+            layoutConsole(c);
+    }
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// setupServers
+// ////////////////////////////////////////////////////////////////////////////
+// reads the "pilight" section of the config, a single server or a list, e.g.
+// "pilight" : [ { "server" : "10.10.0.1", "port" : 5000 },
+//               { "server" : "10.10.0.2", "port" : 5000, "name" : "garage" } ]
+// serverOption (-p host:port) leaves only the first server, at that address.
+// ////////////////////////////////////////////////////////////////////////////
+
+void checkDeviceServers();
+
+void setupServers(char *serverOption)
+{
+    json_t *list = json_object_get(globalConfig, "pilight");
+    int i;
+
+    serverCount = json_is_array(list) ? json_array_size(list) : 1;
+    if (serverOption)
+        serverCount = 1;
+    if (serverCount > MAXSERVERS)
+    {
+        printf("Error: only %d pilight servers supported, the rest is ignored\n", MAXSERVERS);
+        serverCount = MAXSERVERS;
+    }
+    valuesPending = serverCount;
+
+    for (i = 0; i < serverCount; i++)
+    {
+        struct server *s = &servers[i];
+        json_t *node = json_is_array(list) ? json_array_get(list, i) : list;
+
+        s->name = json_string_value(json_object_get(node, "name"));
+        s->host = json_string_value(json_object_get(node, "server"));
+        s->port = json_integer_value(json_object_get(node, "port"));
+        s->uuid = json_string_value(json_object_get(node, "uuid"));
+        if (!s->uuid)
+            s->uuid = PILIGHTUUID;
+
+        if (serverOption)
+        {
+            char *colon = strrchr(serverOption, ':');
+            if (colon)
+            {
+                *colon = '\0';
+                s->port = atoi(colon + 1);
+            }
+            s->host = serverOption;
+        }
+        if (!s->port)
+            s->port = PILIGHTPORT;
+
+        s->fd = -1;
+        s->input.server = s;
+        s->input.data = heapAlloc(TCPBUFFER_SIZE);
+        s->input.size = TCPBUFFER_SIZE;
+    }
+
+    checkDeviceServers();
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// checkDeviceServers
+// ////////////////////////////////////////////////////////////////////////////
+// every device needs a server to be controlled and updated
+// ////////////////////////////////////////////////////////////////////////////
+
+void checkDeviceServers()
+{
+    const char *name;
+    int i;
+
+    for (i = 0; i < deviceTable->count; i++)
+        if (!deviceServer(&deviceTable->devices[i], &name))
+            printf("%s \"%s\" belongs to no pilight server, it will never be updated\n",
+                   deviceTable->devices[i].isAlarm ? "alarm" : "device", deviceTable->devices[i].name);
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// consoleSetting
+// ////////////////////////////////////////////////////////////////////////////
+// an integer setting of a console, with the top level of the config as the
+// default for all consoles
+// ////////////////////////////////////////////////////////////////////////////
+
+int consoleSetting(struct console *c, const char *name)
+{
+    json_t *value = json_object_get(c->config, name);
+
+    if (!value)
+        value = json_object_get(globalConfig, name);
+    return json_integer_value(value);
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// socket_connect
+// ////////////////////////////////////////////////////////////////////////////
+// creates a socket on a given port and host and connects to it
+// the socket is non-blocking, so the connect completes in the background:
+// poll() reports it writable when it is up, or an error when it failed.
+// returns -1 if there is no point in waiting (unknown host etc.)
+// ////////////////////////////////////////////////////////////////////////////
+
+
+int socket_connect(char *host, in_port_t port){
+	struct hostent *hp;
+	struct sockaddr_in addr;
+	int on = 1, sock;     
+
+	
+	if((hp = gethostbyname(host)) == NULL){
+		herror("gethostbyname");
+		return -1;
+	}
+	bcopy(hp->h_addr, &addr.sin_addr, hp->h_length);
+	addr.sin_port = htons(port);
+	addr.sin_family = AF_INET;
+	sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+	if(sock == -1){
+		perror("socket");
+		return -1;
+	}
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(int));
+	
+	// make non-blocking
+	
+	long save_fd = fcntl( sock, F_GETFL );
+	save_fd |= O_NONBLOCK;
+	fcntl( sock, F_SETFL, save_fd );
+	
+	if( (connect(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) == -1) && (errno != EINPROGRESS) ){
+		perror("connect");
+		close(sock);
+		return -1;
+	}
+  
+	
+	return sock;
+}
+
+
+// ////////////////////////////////////////////////////////////////////////////
+// set_interface_attribs
+// ////////////////////////////////////////////////////////////////////////////
+// sets the attributes for communication on the serial port
+// from stackoverflow.com (by RicoRico, sawdust)
+// ////////////////////////////////////////////////////////////////////////////
+
+int set_interface_attribs(int fd, int speed, int mcount)
+{
+    struct termios tty;
+
+    if (tcgetattr(fd, &tty) < 0) {
+        printf("Error from tcgetattr: %s\n", strerror(errno));
+        return -1;
+    }
+
+    cfsetospeed(&tty, (speed_t)speed);
+    cfsetispeed(&tty, (speed_t)speed);
+
+    tty.c_cflag |= (CLOCAL | CREAD);                    /* ignore modem controls */
+    tty.c_cflag &= ~CSIZE;                              /* */
+    tty.c_cflag |= CS8;                                 /* 8-bit characters */
+    tty.c_cflag &= ~PARENB;                             /* no parity bit */
+    tty.c_cflag &= ~CSTOPB;                             /* only need 1 stop bit */
+    tty.c_cflag &= ~CRTSCTS;                            /* no hardware flowcontrol */
+    tty.c_iflag &= ~(IXON | IXOFF | IXANY);             /* No XON/XOFF */
+    tty.c_lflag &= ~(ECHO | ECHOE | ICANON | ISIG);     /* */
+    tty.c_oflag &= ~OPOST;                              /* */
+
+    /* fetch bytes as they become available */
+
+    tty.c_cc[VMIN]  = 1;
+    tty.c_cc[VTIME] = 1;
+
+    if (tcsetattr(fd, TCSANOW, &tty) != 0) {
+        printf("Error from tcsetattr: %s\n", strerror(errno));
+        return -1;
+    }
+
+    tty.c_cc[VMIN] =  mcount ? 1 : 0;
+    tty.c_cc[VTIME] = 5;                /* half second timer */
+
+    if (tcsetattr(fd, TCSANOW, &tty) < 0)
+    {
+        printf("Error tcsetattr: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// nowMillis
+// ////////////////////////////////////////////////////////////////////////////
+// returns a monotonic timestamp in milliseconds
+// ////////////////////////////////////////////////////////////////////////////
+
+long long nowMillis()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// nowMicros
+// ////////////////////////////////////////////////////////////////////////////
+// returns a monotonic timestamp in microseconds
+// ////////////////////////////////////////////////////////////////////////////
+
+long long nowMicros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// observe
+// ////////////////////////////////////////////////////////////////////////////
+// counts a duration in microseconds into a histogram. Bucket b takes the
+// values below 2^b us, found from the bit length instead of a search.
+// ////////////////////////////////////////////////////////////////////////////
+
+void observe(struct histogram *h, long long us)
+{
+    int b;
+
+    if (us < 0)
+        us = 0;
+    b = us ? 64 - __builtin_clzll((unsigned long long) us) : 0;
+    if (b >= HISTOGRAM_BUCKETS)
+        b = HISTOGRAM_BUCKETS - 1;
+
+    h->bucket[b]++;
+    h->count++;
+    h->sum += us;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// linkOf / captureTraffic
+// ////////////////////////////////////////////////////////////////////////////
+// logs raw bytes read from or written to a link if capturing is enabled.
+// Every record is a header line
+//     <seconds>.<microseconds> <direction><link> <length>
+// followed by the bytes and a newline. direction is < for received and >
+// for sent, link is T for the first pilight server, a..g for the others, S
+// for the first Arduino and 1..7 for the other consoles. The time counts from
+// the start of the daemon. pilight-console-replay plays back T and S.
+// ////////////////////////////////////////////////////////////////////////////
+
+char linkOf(int fd)
+{
+    int i;
+
+    for (i = 0; i < consoleCount; i++)
+        if (consoles[i].fd == fd)
+            return i ? '0' + i : 'S';
+    for (i = 0; i < serverCount; i++)
+        if (servers[i].fd == fd)
+            return i ? 'a' + i - 1 : 'T';
+    return '-';
+}
+
+void captureTraffic(char direction, int fd, const char *data, int len)
+{
+    long long t;
+
+    if (!captureFile || (len <= 0))
+        return;
+
+    t = nowMicros() - captureStart;
+    fprintf(captureFile, "%lld.%06lld %c%c %d\n", t / 1000000, t % 1000000, direction, linkOf(fd), len);
+    fwrite(data, 1, len, captureFile);
+    fputc('\n', captureFile);
+    fflush(captureFile);
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// traceOpen / traceDevices / trace
+// ////////////////////////////////////////////////////////////////////////////
+// the trace is a ring of fixed size records in a file mapped into memory.
+// Writing a record is a few stores, no formatting and no system call, so it
+// can stay on all the time. The pages belong to the file, so the last events
+// before a crash are still in it afterwards; the trace of the run before is
+// kept as <file>.1. pilight-console-tracedump prints it. Records name a
+// device by its place in the names of the file. A reload only appends the
+// names that are new, so older records still show the right device.
+// ////////////////////////////////////////////////////////////////////////////
+
+void traceOpen(const char *name, int records)
+{
+    char previous[256];
+    size_t size;
+    void *map;
+    int fd;
+
+    if (records <= 0)
+        records = TRACE_RECORDS;
+    size = sizeof(struct traceHeader) + TRACE_MAXNAMES * TRACE_NAMESIZE + (size_t) records * sizeof(struct traceRecord);
+
+    snprintf(previous, sizeof(previous), "%s.1", name);
+    rename(name, previous);
+
+    if (((fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) || (ftruncate(fd, size) < 0))
+    {
+        printf("Error opening trace %s: %s\n", name, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        printf("Error mapping trace %s: %s\n", name, strerror(errno));
+        return;
+    }
+
+    traceHeader = map;
+    traceNames = (void *) (traceHeader + 1);
+    traceRing = (void *) (traceNames + TRACE_MAXNAMES);
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    traceHeader->recordSize = sizeof(struct traceRecord);
+    traceHeader->records = records;
+    traceHeader->nameSize = TRACE_NAMESIZE;
+    traceHeader->started = (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    traceStart = nowMicros();
+    memcpy(traceHeader->magic, TRACE_MAGIC, sizeof(traceHeader->magic));
+}
+
+void traceDevices()
+{
+    char name[TRACE_NAMESIZE];
+    int i, n;
+
+    if (!traceHeader)
+        return;
+    for (i = 0; i < deviceTable->count; i++)
+    {
+        struct device *dev = &deviceTable->devices[i];
+
+        snprintf(name, sizeof(name), "%s", dev->name);
+        for (n = 0; n < traceHeader->names; n++)
+            if (strcmp(traceNames[n], name) == 0)
+                break;
+        if (n == TRACE_MAXNAMES)
+        {
+            dev->traceId = TRACE_NONE;
+            continue;
+        }
+        if (n == traceHeader->names)
+        {
+            memcpy(traceNames[n], name, sizeof(name));
+            traceHeader->names = n + 1;
+        }
+        dev->traceId = n;
+    }
+}
+
+void trace(int type, char link, int device, int length)
+{
+    struct traceRecord *r;
+
+    if (!traceHeader)
+        return;
+
+    r = &traceRing[traceHeader->written % traceHeader->records];
+    r->time = nowMicros() - traceStart;
+    r->type = type;
+    r->link = link;
+    r->device = device;
+    r->length = length;
+    traceHeader->written++;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// scheduleTimer / cancelTimer
+// ////////////////////////////////////////////////////////////////////////////
+// one-shot timers for the main loop. A callback can only be scheduled once
+// per argument, scheduling it again moves its deadline.
+// ////////////////////////////////////////////////////////////////////////////
+
+void scheduleTimer(timerCallback callback, void *arg, int ms)
+{
+    int i, freeSlot = -1;
+
+    for (i = 0; i < MAXTIMERS; i++)
+    {
+        if (timers[i].deadline && (timers[i].callback == callback) && (timers[i].arg == arg))
+            break;
+        if (!timers[i].deadline && freeSlot < 0)
+            freeSlot = i;
+    }
+    if (i == MAXTIMERS)
+        i = freeSlot;
+    if (i < 0)
+    {
+        printf("Error: no free timer slot\n");
+        return;
+    }
+    timers[i].callback = callback;
+    timers[i].arg = arg;
+    timers[i].deadline = nowMillis() + ms;
+}
+
+void cancelTimer(timerCallback callback, void *arg)
+{
+    int i;
+    for (i = 0; i < MAXTIMERS; i++)
+        if ( (timers[i].callback == callback) && (timers[i].arg == arg) )
+            timers[i].deadline = 0;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// runTimers
+// ////////////////////////////////////////////////////////////////////////////
+// fires all timers that are due and returns the number of ms until the next
+// one, or -1 if none is pending (suitable as poll() timeout)
+// ////////////////////////////////////////////////////////////////////////////
+
+int runTimers()
+{
+    long long now = nowMillis();
+    long long next = -1;
+    int i;
+
+    for (i = 0; i < MAXTIMERS; i++)
+    {
+        if (timers[i].deadline && timers[i].deadline <= now)
+        {
+            timerCallback callback = timers[i].callback;
+            timers[i].deadline = 0;
+            callback(timers[i].arg);
+            now = nowMillis();
+        }
+    }
+
+    // callbacks may have scheduled new timers, so look again
+
+    for (i = 0; i < MAXTIMERS; i++)
+    {
+        if (timers[i].deadline)
+        {
+            long long left = timers[i].deadline - now;
+            if (left < 0)
+                left = 0;
+            if ((next < 0) || (left < next))
+                next = left;
+        }
+    }
+    return (int) next;
+}
+
+
+// ////////////////////////////////////////////////////////////////////////////
+// ringPut / ringGet / ringUsed / linkWake
+// ////////////////////////////////////////////////////////////////////////////
+// the byte rings between the link threads and the main loop (-T). Both put
+// and get take as much as fits and return how much that was. The indexes
+// and the sleeping flags are sequentially consistent: a side that goes to
+// sleep sets its flag before it looks at the index once more, the other
+// side moves the index before it looks at the flag, so one of them always
+// sees the other.
+// ////////////////////////////////////////////////////////////////////////////
+
+unsigned int ringUsed(struct byteRing *r)
+{
+    return __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) - __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+}
+
+int ringPut(struct byteRing *r, const char *data, int len)
+{
+    unsigned int tail = r->tail;
+    unsigned int room = LINK_RING - (tail - __atomic_load_n(&r->head, __ATOMIC_SEQ_CST));
+    unsigned int at = tail % LINK_RING;
+    unsigned int first;
+
+    if ((unsigned int) len > room)
+        len = room;
+    first = (LINK_RING - at < (unsigned int) len) ? LINK_RING - at : (unsigned int) len;
+    memcpy(r->data + at, data, first);
+    memcpy(r->data, data + first, len - first);
+    __atomic_store_n(&r->tail, tail + len, __ATOMIC_SEQ_CST);
+    return len;
+}
+
+int ringGet(struct byteRing *r, char *data, int len)
+{
+    unsigned int head = r->head;
+    unsigned int used = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) - head;
+    unsigned int at = head % LINK_RING;
+    unsigned int first;
+
+    if ((unsigned int) len > used)
+        len = used;
+    first = (LINK_RING - at < (unsigned int) len) ? LINK_RING - at : (unsigned int) len;
+    memcpy(data, r->data + at, first);
+    memcpy(data + first, r->data, len - first);
+    __atomic_store_n(&r->head, head + len, __ATOMIC_SEQ_CST);
+    return len;
+}
+
+void linkWake(int *sleeping, int wake)
+{
+    uint64_t one = 1;
+
+    if (__atomic_load_n(sleeping, __ATOMIC_SEQ_CST))
+        write(wake, &one, sizeof(one));
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// unitLength
+// ////////////////////////////////////////////////////////////////////////////
+// length of the line or frame that starts at p, or of what is left of it if
+// it was written partially. Never more than there is up to end.
+// ////////////////////////////////////////////////////////////////////////////
+
+int unitLength(struct outQueue *q, const char *p, const char *end)
+{
+    int len;
+
+    if ( (p == q->data + q->head) && q->partialLeft )
+        len = q->partialLeft;
+    else if (q->framed)
+        len = (end - p >= 2) ? FRAME_OVERHEAD + (unsigned char) p[1] : end - p;
+    else
+    {
+        const char *nl = memchr(p, '\n', end - p);
+        len = nl ? (nl - p) + 1 : end - p;
+    }
+    return (len < end - p) ? len : end - p;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// queueWritable
+// ////////////////////////////////////////////////////////////////////////////
+// returns 1 if the queue has data that may be written right now
+// ////////////////////////////////////////////////////////////////////////////
+
+int queueWritable(struct outQueue *q)
+{
+    if ((q->head == q->tail) || (q->fd < 0))
+        return 0;
+    if (q->window == 0)
+        return 1;
+    if ( (q->inFlight == 0) || (q->lines < (q->acked ? MAXINFLIGHT : 1)) )
+    {
+        int len = unitLength(q, q->data + q->head, q->data + q->tail);
+        return (q->inFlight == 0) || (q->inFlight + len <= q->window);
+    }
+    return 0;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// ackTimeout
+// ////////////////////////////////////////////////////////////////////////////
+// the Arduino did not acknowledge in time (lost ACK or an old sketch that
+// does not send any) - consider everything in flight as processed. Until the
+// first ACK is seen only one line is sent per timeout, as old sketches cannot
+// handle more than one line at once. With frames a missing ACK means a frame
+// got lost on the way, so the whole display is repainted - once, a sketch
+// that does not answer at all would otherwise be repainted forever. After
+// ACK_RESET of them in a row the Arduino has most likely been reset and
+// talks ASCII at the base speed again, the link starts over. Until then an
+// idle link is probed with a STATS request, so the count goes on.
+// ////////////////////////////////////////////////////////////////////////////
+
+void flushQueue(struct outQueue *q);
+void lcdInvalidate(struct console *c);
+void consoleReset(struct console *c, const char *why);
+void sendFrame(struct console *c, int opcode, const unsigned char *payload, int len);
+
+void ackTimeout(void *arg)
+{
+    struct console *c = arg;
+
+    c->queue.inFlight = 0;
+    c->queue.lines = 0;
+    c->queue.firstLine = 0;
+    if (c->queue.framed && (c->ackMisses >= ACK_RESET - 1))
+    {
+        consoleReset(c, "no ACK");
+        return;
+    }
+    if (c->queue.framed && (c->ackMisses++ == 0))
+        lcdInvalidate(c);
+    flushQueue(&c->queue);
+    if (c->queue.framed && (c->queue.lines == 0))
+        sendFrame(c, OP_STATS, NULL, 0);
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// ackLine
+// ////////////////////////////////////////////////////////////////////////////
+// the Arduino has processed the oldest line in flight
+// ////////////////////////////////////////////////////////////////////////////
+
+void ackLine(struct console *c)
+{
+    struct outQueue *q = &c->queue;
+
+    q->acked = 1;
+    c->ackMisses = 0;
+    if (q->lines > 0)
+    {
+        q->inFlight -= q->lineLen[q->firstLine];
+        q->firstLine = (q->firstLine + 1) % MAXINFLIGHT;
+        q->lines--;
+    }
+    if (q->lines == 0)
+    {
+        q->inFlight = q->partial;
+        cancelTimer(ackTimeout, c);
+    }
+    else
+        scheduleTimer(ackTimeout, c, ACK_TIMEOUT);
+    flushQueue(q);
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// linkWrite / flushQueue
+// ////////////////////////////////////////////////////////////////////////////
+// writes as many queued commands as the link currently accepts in a single
+// write() call. Never blocks. With -T linkWrite() takes the place of write()
+// and hands the bytes to the writer thread; if they do not all fit, the
+// writer wakes the main loop once it has made room.
+// ////////////////////////////////////////////////////////////////////////////
+
+int linkWrite(struct linkThreads *t, const char *data, int len)
+{
+    int put = ringPut(&t->out, data, len);
+
+    while (put < len)
+    {
+        __atomic_store_n(&t->outFull, 1, __ATOMIC_SEQ_CST);
+        if (ringUsed(&t->out) == LINK_RING)
+            break;
+        put += ringPut(&t->out, data + put, len - put);
+    }
+    linkWake(&t->writerSleeping, t->writerWake);
+    return put;
+}
+
+void flushQueue(struct outQueue *q)
+{
+    int len = q->tail - q->head;
+    int wlen;
+
+    if (!queueWritable(q))
+        return;
+
+    // on a flow controlled link only send complete lines that fit the window
+
+    if (q->window)
+    {
+        int room = q->window - q->inFlight;
+        int lines = q->lines;
+        int maxLines = q->acked ? MAXINFLIGHT : 1;
+        char *p = q->data + q->head;
+        char *end = q->data + q->tail;
+
+        len = 0;
+        while ( (p < end) && (lines < maxLines) )
+        {
+            int lineLen = unitLength(q, p, end);
+            if ( (len + lineLen > room) && ((len > 0) || (q->inFlight > 0)) )
+                break;
+            len += lineLen;
+            p += lineLen;
+            lines++;
+        }
+    }
+
+    long long before = nowMicros(), after;
+
+    if (q->threads)
+        wlen = linkWrite(q->threads, q->data + q->head, len);
+    else
+        wlen = write(q->fd, q->data + q->head, len);
+    if (wlen <= 0)
+    {
+        if ( (wlen < 0) && (errno != EAGAIN) && (errno != EINTR) )
+            printf("Error from write: %d, %d\n", wlen, errno);
+        return;
+    }
+    after = nowMicros();
+    captureTraffic('>', q->fd, q->data + q->head, wlen);
+    trace(TR_WRITE, linkOf(q->fd), TRACE_NONE, wlen);
+
+    observe(&stageTime[STAGE_WRITE], after - before);
+    observe(&stageTime[STAGE_QUEUE], before - q->waitingSince);
+    q->waitingSince = before;
+    q->bytesOut += wlen;
+    if (q->originAt)
+    {
+        observe(&pathTime[q->console ? PATH_UPDATE : PATH_CONTROL], after - q->originAt);
+        q->originAt = 0;
+    }
+
+    // the urgent data follows the rest of the unit at head
+
+    int urgentEnd = q->partialLeft + q->urgent;
+
+    // remember where the write stopped, and on a flow controlled link the
+    // length of every line that went out completely
+
+    char *p = q->data + q->head;
+    char *end = p + wlen;
+    while (p < end)
+    {
+        int lineLen = unitLength(q, p, q->data + q->tail);
+        if (p + lineLen > end)
+        {
+            q->partial += end - p;
+            q->partialLeft = lineLen - (end - p);
+            break;
+        }
+        if (q->window)
+        {
+            q->lineLen[(q->firstLine + q->lines) % MAXINFLIGHT] = q->partial + lineLen;
+            q->lines++;
+        }
+        q->partial = q->partialLeft = 0;
+        p += lineLen;
+    }
+
+    // an urgent unit that is now partly written counts in partialLeft, as
+    // urgent as well the next urgent data would be put in too far back
+
+    if (q->urgent)
+    {
+        q->urgent = urgentEnd - wlen - q->partialLeft;
+        if (q->urgent <= 0)
+        {
+            q->urgent = 0;
+            if (q->console)
+                observe(&pathTime[PATH_ALARM], after - q->urgentAt);
+        }
+    }
+    if (q->window)
+    {
+        q->inFlight += wlen;
+        scheduleTimer(ackTimeout, q->console, ACK_TIMEOUT);
+    }
+
+    q->head += wlen;
+    if (q->head == q->tail)
+        q->head = q->tail = 0;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// queueData / sendCommand - send a command to Arduino or pilight
+// ////////////////////////////////////////////////////////////////////////////
+// the command is queued and written as soon as the link allows it
+// ////////////////////////////////////////////////////////////////////////////
+
+void queueData(struct outQueue *q, const char *data, int len)
+{
+    if (q->tail + len > OUTQUEUE_SIZE)
+    {
+        memmove(q->data, q->data + q->head, q->tail - q->head);
+        q->tail -= q->head;
+        q->head = 0;
+    }
+    if (q->tail + len > OUTQUEUE_SIZE)
+    {
+        printf("Error: output queue full, dropping %d bytes\n", len);
+        trace(TR_DROP, linkOf(q->fd), TRACE_NONE, len);
+        return;
+    }
+    if (q->head == q->tail)
+        q->waitingSince = nowMicros();
+
+    // remember when the input was read that made us send this, pilight
+    // updates for the display and keypad input for pilight
+
+    if (inputAt && !q->originAt && ((inputLink->console != NULL) != (q->console != NULL)))
+        q->originAt = inputAt;
+
+    // urgent data goes right behind the unit that is partly written and the
+    // urgent data queued before it
+
+    if (urgentOutput)
+    {
+        int at = q->head + q->partialLeft + q->urgent;
+
+        memmove(q->data + at + len, q->data + at, q->tail - at);
+        memcpy(q->data + at, data, len);
+        if (!q->urgent)
+            q->urgentAt = inputAt ? inputAt : nowMicros();
+        q->urgent += len;
+    }
+    else
+        memcpy(q->data + q->tail, data, len);
+    q->tail += len;
+    q->linesOut++;
+
+    flushQueue(q);
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// cancelRedraws
+// ////////////////////////////////////////////////////////////////////////////
+// drops the display output of a console that is still queued, leaving key
+// acknowledgements and the like. Returns the bytes dropped; the caller has
+// to paint the display again from the frame buffer.
+// ////////////////////////////////////////////////////////////////////////////
+
+int cancelRedraws(struct outQueue *q)
+{
+    char *p = q->data + q->head + q->partialLeft + q->urgent;
+    char *end = q->data + q->tail;
+    char *keep = p;
+
+    while (p < end)
+    {
+        int len = unitLength(q, p, end);
+        int redraw;
+
+        if (q->framed)
+            redraw = (p[2] == OP_SPAN) || (p[2] == OP_CLEAR) || (p[2] == OP_SEVERITY);
+        else
+            redraw = !strncmp(p, "MESSAGE ", 8) || !strncmp(p, "CLEAR\n", 6);
+        if (!redraw)
+        {
+            memmove(keep, p, len);
+            keep += len;
+        }
+        p += len;
+    }
+    q->tail = keep - q->data;
+    return end - keep;
+}
+
+void sendCommand (int fd, char* theCommand )
+{
+    struct outQueue *q = NULL;
+    int i;
+
+    if (fd < 0)                     // the link is down, the command is lost
+        return;
+    for (i = 0; i < consoleCount; i++)
+        if (consoles[i].fd == fd)
+            q = &consoles[i].queue;
+    for (i = 0; i < serverCount; i++)
+        if (servers[i].fd == fd)
+            q = &servers[i].queue;
+    if (!q)
+        return;
+
+    if (verbose)
+        printf ("COMMAND %s", theCommand);
+    trace(TR_COMMAND, linkOf(fd), TRACE_NONE, strlen(theCommand));
+
+    queueData(q, theCommand, strlen(theCommand));
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// crc8
+// ////////////////////////////////////////////////////////////////////////////
+// CRC-8 with polynomial 0x07 as used by the protocol 2 frames
+// ////////////////////////////////////////////////////////////////////////////
+
+unsigned char crc8(unsigned char crc, const unsigned char *data, int len)
+{
+    int i;
+
+    while (len--)
+    {
+        crc ^= *data++;
+        for (i = 0; i < 8; i++)
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// sendFrame - send a protocol 2 frame to the Arduino
+// ////////////////////////////////////////////////////////////////////////////
+// like sendCommand the frame is queued and written as soon as the link and
+// the flow control allow it
+// ////////////////////////////////////////////////////////////////////////////
+
+void sendFrame(struct console *c, int opcode, const unsigned char *payload, int len)
+{
+    unsigned char frame[FRAME_MAXPAYLOAD + FRAME_OVERHEAD + 1];
+
+    if (len > FRAME_MAXPAYLOAD)
+        len = FRAME_MAXPAYLOAD;
+    frame[0] = PROTO_SYNC;
+    frame[1] = len;
+    frame[2] = opcode;
+    memcpy(frame + 3, payload, len);
+    frame[3 + len] = crc8(0, frame + 1, len + 2);
+
+    if (verbose)
+        printf("FRAME %02x %d\n", opcode, len);
+    trace(TR_FRAME, linkOf(c->fd), opcode, len);
+    queueData(&c->queue, (char *) frame, len + FRAME_OVERHEAD);
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// lcdClear / lcdPrint / lcdPrintLine
+// ////////////////////////////////////////////////////////////////////////////
+// draw into the frame buffer of a console. Nothing is sent until lcdFlush().
+// severity - the severity the text is sent with (see MESSAGE)
+// ////////////////////////////////////////////////////////////////////////////
+
+void lcdClear(struct console *c)
+{
+    memset(c->lcdFrame, ' ', sizeof(c->lcdFrame));
+    c->lcdCleared = 1;
+    c->lcdDirty = 1;
+}
+
+void lcdPrint(struct console *c, int severity, int x, int y, const char *text)
+{
+    int width = (y == LCDHEIGHT-1) ? KEYFIELDCOL : LCDWIDTH;
+
+    if ( (y < 0) || (y >= LCDHEIGHT) )
+        return;
+    for (; (x < width) && *text; x++, text++)
+        if (x >= 0)
+            c->lcdFrame[y][x] = ((unsigned char) *text < ' ') ? ' ' : *text;
+    if (severity > c->lcdSeverity)      // a routine line does not demote an alarm
+        c->lcdSeverity = severity;
+    c->lcdDirty = 1;
+}
+
+void lcdPrintLine(struct console *c, int severity, int y, const char *text)
+{
+    char theLine[LCDWIDTH+1];
+
+    snprintf(theLine, sizeof(theLine), "%-*s", LCDWIDTH, text);
+    lcdPrint(c, severity, 0, y, theLine);
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// lcdInvalidate
+// ////////////////////////////////////////////////////////////////////////////
+// forget what the display shows, the next lcdFlush() repaints all of it
+// ////////////////////////////////////////////////////////////////////////////
+
+void lcdInvalidate(struct console *c)
+{
+    memset(c->lcdShadow, 0, sizeof(c->lcdShadow));
+    c->lcdDirty = 1;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// lcdDiff
+// ////////////////////////////////////////////////////////////////////////////
+// finds the spans of the frame that differ from the shadow (or from a blank
+// display) and returns the number of bytes needed to send them. Changes
+// closer together than the cost of another MESSAGE header are merged into
+// one span. With emit set the spans are sent and the shadow is updated.
+// ////////////////////////////////////////////////////////////////////////////
+
+int lcdDiff(struct console *c, int againstBlank, int emit)
+{
+    int overhead = (c->proto == 2) ? FRAME_OVERHEAD + 3 : SPAN_OVERHEAD;
+    int bytes = 0;
+    int x, y;
+
+    for (y = 0; y < LCDHEIGHT; y++)
+    {
+        int width = (y == LCDHEIGHT-1) ? KEYFIELDCOL : LCDWIDTH;
+        const char *old = c->lcdShadow[y];
+        const char *new = c->lcdFrame[y];
+
+        x = 0;
+        while (x < width)
+        {
+            int start, end;
+
+            if (new[x] == (againstBlank ? ' ' : old[x]))
+            {
+                x++;
+                continue;
+            }
+
+            // extend the span as long as the next change is close enough
+
+            start = x;
+            end = ++x;
+            for (; x < width; x++)
+            {
+                if (new[x] != (againstBlank ? ' ' : old[x]))
+                {
+                    if (x - end >= overhead)
+                        break;
+                    end = x + 1;
+                }
+            }
+            x = end;
+
+            bytes += overhead + end - start;
+
+            if (emit && (c->proto == 2))
+            {
+                unsigned char payload[LCDWIDTH+3] = { c->lcdSeverity, start, y };
+                memcpy(payload + 3, new + start, end - start);
+                sendFrame(c, OP_SPAN, payload, 3 + end - start);
+            }
+            else if (emit)
+            {
+                char Command[LCDWIDTH+32];
+                sprintf(Command, "MESSAGE %d %d %d %.*s\n", c->lcdSeverity, start, y, end - start, new + start);
+                sendCommand(c->fd, Command);
+            }
+            if (emit)
+                memcpy(c->lcdShadow[y] + start, new + start, end - start);
+        }
+    }
+    return bytes;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// lcdFlush
+// ////////////////////////////////////////////////////////////////////////////
+// brings the display in line with the frame buffer using as few bytes as
+// possible - a CLEAR is only sent if it is cheaper than overwriting
+// ////////////////////////////////////////////////////////////////////////////
+
+void lcdFlush(struct console *c)
+{
+    if (!c->lcdDirty || !c->ready || c->protoNegotiating)
+        return;
+
+    // an alarm does not wait behind routine redraws. What they would have
+    // drawn is in the frame buffer, so the alarm frame is painted instead.
+
+    if (c->lcdSeverity >= SV_HI)
+    {
+        if (cancelRedraws(&c->queue))
+        {
+            lcdInvalidate(c);
+            c->lcdCleared = 1;
+        }
+        urgentOutput = 1;
+    }
+
+    if (c->lcdCleared && (((c->proto == 2) ? FRAME_OVERHEAD : strlen("CLEAR\n")) + lcdDiff(c, 1, 0) < lcdDiff(c, 0, 0)))
+    {
+        if (c->proto == 2)
+            sendFrame(c, OP_CLEAR, NULL, 0);
+        else
+            sendCommand(c->fd, "CLEAR\n");
+        memset(c->lcdShadow, ' ', sizeof(c->lcdShadow));
+    }
+
+    // nothing changed, but the severity still has to reach the Arduino
+    // as it switches the backlight on
+
+    if ( (lcdDiff(c, 0, 1) == 0) && (c->lcdSeverity > SV_LO) )
+    {
+        if (c->proto == 2)
+        {
+            unsigned char severity = c->lcdSeverity;
+            sendFrame(c, OP_SEVERITY, &severity, 1);
+        }
+        else
+        {
+            char Command[32];
+            sprintf(Command, "MESSAGE %d 0 0\n", c->lcdSeverity);
+            sendCommand(c->fd, Command);
+        }
+    }
+
+    c->lcdCleared = 0;
+    c->lcdDirty = 0;
+    c->lcdSeverity = SV_LO;
+    urgentOutput = 0;
+
+    if (!c->painted && !valuesPending)
+    {
+        c->painted = 1;
+        printf("console %s: first screen %lld ms after start\n", c->port, nowMillis() - startedAt);
+    }
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// pinCodeMessage - show a line asking for pincode on the display
+// ////////////////////////////////////////////////////////////////////////////
+// severity - the severity state
+// ClearDisplay - clear the display before showing the pincode message
+// ////////////////////////////////////////////////////////////////////////////
+
+void pinCodeMessage(struct console *c, int severity,int clearDisplay)
+{
+    if (clearDisplay==1)
+    {
+        lcdClear(c);
+    }
+    if (c->pinValid)
+    {
+        lcdPrint(c, severity, 0, LCDHEIGHT-1, "PIN OK    ");
+    }
+    else
+    {
+        lcdPrint(c, severity, 0, LCDHEIGHT-1, "PINCODE ->");
+    }
+
+    // with more than one page, which one this is. MAXPAGES keeps both
+    // numbers to one digit.
+
+    if (c->pageCount > 1)
+    {
+        char thePage[5] = { ' ', '1' + c->page, '/', '0' + c->pageCount, '\0' };
+
+        lcdPrint(c, severity, KEYFIELDCOL - 4, LCDHEIGHT-1, thePage);
+    }
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// translateValue / deviceLine
+// ////////////////////////////////////////////////////////////////////////////
+// the text shown for a value as pilight reports it, and the display line of
+// a device. A value switched on the keypad but not yet confirmed by pilight
+// is marked with a * in the last column.
+// ////////////////////////////////////////////////////////////////////////////
+
+void translateValue(struct device *dev, const char *raw, char *shown)
+{
+    int t;
+
+    for (t = 0; t < dev->translations; t++)
+        if (strcmp(dev->translate[t].from, raw) == 0)
+        {
+            snprintf(shown, VALUESIZE, "%s", dev->translate[t].to);
+            return;
+        }
+    if (shown != raw)
+        snprintf(shown, VALUESIZE, "%s", raw);
+}
+
+void deviceLine(struct device *dev, char *theLine)
+{
+    char full[2 * LCDWIDTH + VALUESIZE];
+    int width = dev->pendingId ? LCDWIDTH - 1 : LCDWIDTH;
+
+    // the mark takes the last column, whatever the line has to give up for it
+
+    snprintf(full, sizeof(full), "%s: %s", dev->friendlyName, dev->currentValue);
+    snprintf(theLine, LCDWIDTH+1, "%-*.*s", width, width, full);
+    if (dev->pendingId)
+        strcpy(theLine + width, "*");
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// onScreen / showKeys / paintPage / showPage
+// ////////////////////////////////////////////////////////////////////////////
+// a console shows one page of devices at a time. Devices on other pages are
+// only kept in the device table, switching pages draws from there without
+// asking pilight.
+// ////////////////////////////////////////////////////////////////////////////
+
+int onScreen(struct console *c, int i)
+{
+    return (c->layout[i].line >= 0) && (c->layout[i].page == c->page);
+}
+
+void showKeys(struct console *c, int show)
+{
+    int i;
+
+    for (i = 0; i < deviceTable->count; i++)
+        if (c->layout[i].key && onScreen(c, i))
+        {
+            char theKey[2] = { show ? c->layout[i].key : ' ', '\0' };
+            lcdPrint(c, SV_LO, LCDWIDTH-1, c->layout[i].line, theKey);
+        }
+}
+
+void paintPage(struct console *c)
+{
+    int i, y;
+
+    // during an alarm the display is the alarm's
+
+    if (systemState == ST_ALARM)
+        return;
+
+    for (y = 0; y < LCDHEIGHT-1; y++)
+        lcdPrintLine(c, SV_LO, y, "");
+    for (i = 0; i < deviceTable->count; i++)
+    {
+        struct device *dev = &deviceTable->devices[i];
+        char theLine[LCDWIDTH+1];
+
+        if (dev->isAlarm || !dev->rawValue[0] || !onScreen(c, i))
+            continue;
+        deviceLine(dev, theLine);
+        lcdPrintLine(c, SV_LO, c->layout[i].line, theLine);
+    }
+    if (c->pinValid)
+        showKeys(c, 1);
+    pinCodeMessage(c, SV_LO, 0);
+}
+
+void showPage(struct console *c, int page)
+{
+    c->page = page % c->pageCount;
+    paintPage(c);
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// renderDevices / renderTick / deviceChanged
+// ////////////////////////////////////////////////////////////////////////////
+// updates only mark a device dirty, its line is drawn at most once per
+// FRAME_TICK with the last value it got. A sensor that reports in bursts
+// costs one line on the display per tick, however many updates it sends.
+// The first change after a quiet period is drawn right away.
+// ////////////////////////////////////////////////////////////////////////////
+
+void renderDevices()
+{
+    int i, c;
+
+    for (i = 0; i < deviceTable->count; i++)
+    {
+        struct device *dev = &deviceTable->devices[i];
+        char theLine[LCDWIDTH+1];
+
+        if (!dev->dirty)
+            continue;
+        dev->dirty = 0;
+
+        // during an alarm the display is the alarm's, the pages are
+        // painted again when it is reset
+
+        if (systemState == ST_ALARM)
+            continue;
+
+        deviceLine(dev, theLine);
+        for (c = 0; c < consoleCount; c++)
+        {
+            struct console *con = &consoles[c];
+
+            if (!onScreen(con, i))
+                continue;
+            pinCodeMessage(con, SV_LO, 0);
+            lcdPrintLine(con, SV_LO, con->layout[i].line, theLine);
+        }
+    }
+}
+
+void renderTick(void *arg)
+{
+    int c;
+
+    renderPending = 0;
+    lastRender = nowMillis();
+    renderDevices();
+
+    // the display latency counts from the oldest update drawn now
+
+    inputAt = renderInputAt;
+    inputLink = renderInputLink;
+    for (c = 0; c < consoleCount; c++)
+        lcdFlush(&consoles[c]);
+    inputAt = renderInputAt = 0;
+}
+
+void deviceChanged(struct device *dev)
+{
+    long long delay;
+
+    dev->dirty = 1;
+    if (renderPending)
+        return;
+    renderInputAt = inputAt;
+    renderInputLink = inputLink;
+
+    delay = lastRender + FRAME_TICK - nowMillis();
+    renderPending = 1;
+    scheduleTimer(renderTick, NULL, (delay > 0) ? delay : 0);
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// scheduleControlTimeout / controlTimeout / controlConfirmed
+// ////////////////////////////////////////////////////////////////////////////
+// a control action is pending until pilight reports the device with the new
+// value. One timer serves all of them, it fires for the oldest one. If no
+// answer comes within CONTROL_TIMEOUT the value pilight reported last is
+// shown again.
+// ////////////////////////////////////////////////////////////////////////////
+
+void scheduleControlTimeout();
+
+void controlTimeout(void *arg)
+{
+    long long now = nowMicros();
+    struct server *s;
+    const char *name;
+    int i;
+
+    for (i = 0; i < deviceTable->count; i++)
+    {
+        struct device *dev = &deviceTable->devices[i];
+
+        if (!dev->pendingId || (now - dev->pendingAt < CONTROL_TIMEOUT * 1000LL))
+            continue;
+        printf("Error: control #%d of %s to %s not confirmed, back to %s\n",
+               dev->pendingId, dev->name, dev->pendingValue, dev->rawValue);
+        s = deviceServer(dev, &name);
+        trace(TR_ROLLBACK, s ? linkOf(s->fd) : '-', dev->traceId, 0);
+        controlRollbacks++;
+        dev->pendingId = 0;
+        translateValue(dev, dev->rawValue, dev->currentValue);
+        deviceChanged(dev);
+    }
+    scheduleControlTimeout();
+}
+
+void scheduleControlTimeout()
+{
+    long long oldest = 0;
+    int i;
+
+    for (i = 0; i < deviceTable->count; i++)
+        if (deviceTable->devices[i].pendingId && (!oldest || (deviceTable->devices[i].pendingAt < oldest)))
+            oldest = deviceTable->devices[i].pendingAt;
+    if (oldest)
+    {
+        long long delay = (oldest - nowMicros()) / 1000 + CONTROL_TIMEOUT;
+        scheduleTimer(controlTimeout, NULL, (delay > 0) ? delay : 0);
+    }
+    else
+        cancelTimer(controlTimeout, NULL);
+}
+
+void controlConfirmed(struct device *dev)
+{
+    long long took = nowMicros() - dev->pendingAt;
+
+    if (verbose)
+        printf("CONTROL #%d %s confirmed after %lld ms\n", dev->pendingId, dev->name, took / 1000);
+    observe(&pathTime[PATH_CONFIRM], took);
+    dev->pendingId = 0;
+
+    // the line loses its mark
+
+    deviceChanged(dev);
+    scheduleControlTimeout();
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// handleDevice
+// ////////////////////////////////////////////////////////////////////////////
+// wertet eine JSON update Nachricht aus.
+// ////////////////////////////////////////////////////////////////////////////
+
+
+/*
+
+Example of a device section in the config file
+
+"devices":	
+{
+	"feuerscharf"   : {"friendlyname":"Feuermelder",   "value":"state",       "translate":{"on":"scharf", "off":"aus"},"line":1},
+	"alarmscharf"   : {"friendlyname":"Alarmanlage",   "value":"state",       "translate":{"on":"scharf", "off":"aus"},"line":2},
+	"Aussensensor"  : {"friendlyname":"Aussentemp.",   "value":"temperature",                                          "line":0}
+},
+
+Example update messages
+
+{"origin":"update","type":3,"devices":["Aussensensor"],"values":{"timestamp":1510915637,"temperature":6.1,"humidity":74.0,"battery":0.0}}
+{"origin":"update","type":1,"devices":["feuerscharf"],"values":{"timestamp":1510915945,"state":"on"}}
+
+*/
+
+
+void requestValues();
+
+void handleDevice (struct server *server, json_t *updateMessage)
+{
+    // lets have a look at the device node of the incoming message
+     
+    json_t *myJson = json_object_get(updateMessage,"devices");
+    int i;
+
+    // the device node is an array, so we cycle through it
 
     for(i = 0; i < json_array_size(myJson); i++)
     {
-        // lets have a look at one single device
-        
-        json_t *data = json_array_get(myJson, i);
-        if(json_is_string(data))
+        // lets have a look at one single device
+        
+        json_t *data = json_array_get(myJson, i);
+        if(json_is_string(data))
+        {
+            // now we look into the configured devices and alarms
+            // updatedDevice contains the device name
+            
+            const char *updatedDevice = json_string_value(data);
+            struct device *dev = findDevice(deviceTable, server->name, updatedDevice, strlen(updatedDevice));
+
+            if (dev)   // we have configured this device or alarm
+            {
+                int isAlarm = dev->isAlarm;
+                const char *friendlyName = dev->friendlyName;
+
+                // read out the value of the device from the values node of the incoming message
+                
+                json_t *theValue = json_object_get(json_object_get(updateMessage,"values"),dev->valueKey);
+                char theStringValue[VALUESIZE];
+
+                if (!theValue)
+                    continue;
+
+                // depending on the type of the field we need to do some formatting (temperature is real, on/off is string etc.)
+
+                theStringValue[0] = '\0';
+                switch (json_typeof(theValue)) 
+                {
+                    case JSON_REAL:
+                        snprintf(theStringValue,VALUESIZE,"%4.1f",json_real_value(theValue));
+                        break;
+                    case JSON_INTEGER:
+                        snprintf(theStringValue,VALUESIZE,"%lld",(long long) json_integer_value(theValue));
+                        break;
+                    case JSON_STRING:
+                        snprintf(theStringValue,VALUESIZE,"%s",json_string_value(theValue));
+                        break;
+                    default:
+                        break;
+                }        
+                if (server->resyncing && strcmp(dev->rawValue, theStringValue))
+                    server->resyncChanged++;
+                strcpy(dev->rawValue, theStringValue);
+                trace(TR_UPDATE, linkOf(server->fd), dev->traceId, strlen(theStringValue));
+
+                // we might want to translate it, the translations are part of the device record
+
+                if (json_is_string(theValue))
+                    translateValue(dev, theStringValue, theStringValue);
+
+                //printf ("%d : %s : %s = %s\n", lineNumber, friendlyName, dev->valueKey , theStringValue);
+                    
+                // for alarm codes we have defined triggervalue and resetvalue, i.e.
+                // if the device goes to state triggervalue then we have an alarm.
+                // in order to reset it we need to compare to resetvalue
+
+                char theLine[LCDWIDTH+1];
+                int lineSeverity = isAlarm;
+                int clearDisplay = 0;
+                int c;
+                bzero(theLine,LCDWIDTH+1);
+
+                // device lines still waiting for the tick go first, so that
+                // an alarm is drawn over them and not the other way round
+
+                if (isAlarm)
+                    renderDevices();
+
+                // Case 1 : We have received "Alarm on" code
+
+                if  (isAlarm && dev->triggerValue && (strstr(theStringValue,dev->triggerValue))) 
+                {
+                    systemState=ST_ALARM;
+                    clearDisplay = 1;
+                    snprintf (theLine,sizeof(theLine),"%s !!!", friendlyName);
+                    lastAlarm = dev;
+                    trace(TR_ALARM, linkOf(server->fd), dev->traceId, 0);
+                }
+
+                // Case 2 : We have received "Alarm off" code
+
+                // The device table has kept the values during the alarm, so
+                // the pages are painted from there instead of asking pilight
+
+                if (isAlarm && dev->resetValue && (strstr(theStringValue,dev->resetValue)) && (systemState == ST_ALARM)) 
+                {
+                    systemState=ST_NOALARM;
+                    lastAlarm=NULL;
+                    for (c = 0; c < consoleCount; c++)
+                    {
+                        paintPage(&consoles[c]);
+                        pinCodeMessage(&consoles[c], isAlarm-1, 0);
+                    }
+                }
+                    
+                // Case 3 : We have received a non-Alarm code, the line
+                // is drawn with the next tick. A value that is the same
+                // as before, e.g. from a resync, is not drawn again. While
+                // a control action is pending the display keeps showing the
+                // value it asked for, until pilight reports it or it times out.
+
+                if   (!isAlarm && dev->pendingId && (strcmp(dev->rawValue, dev->pendingValue) == 0))
+                    controlConfirmed(dev);
+
+                if   (!isAlarm && !dev->pendingId && strcmp(dev->currentValue, theStringValue))
+                {
+                    strcpy(dev->currentValue, theStringValue);
+                    deviceChanged(dev);
+                }
+
+                // We only print if the line is not empty, filled with spaces
+                // until LCDWIDTH in order to have clean printing on the display.
+                // Alarms go to the first line of every console.
+                
+                for (c = 0; (c < consoleCount) && (strlen(theLine) > 0); c++)
+                {
+                    pinCodeMessage(&consoles[c], isAlarm, clearDisplay);
+                    lcdPrintLine(&consoles[c], lineSeverity, 0, theLine);
+                }
+            }
+        }
+    }
+    
+}
+
+
+// ////////////////////////////////////////////////////////////////////////////
+// arduinoOffline
+// ////////////////////////////////////////////////////////////////////////////
+// the Arduino switched the backlight off after a while without events, or
+// it was reset. Either way the console is locked until the next PIN.
+// ////////////////////////////////////////////////////////////////////////////
+
+void arduinoOffline(struct console *c)
+{
+    c->arduinoState = ST_OFFLINE;
+    if (c->pinValid)
+    {
+        // /////////////////////////
+        // erase toggle keys
+        // /////////////////////////
+
+        showKeys(c, 0);
+        c->pinValid=0;
+        pinCodeMessage(c,SV_LO,0);   
+    }
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// controlDevice / toggleDevice / requestValues
+// ////////////////////////////////////////////////////////////////////////////
+// sends a control action to the pilight server the device belongs to, and
+// asks all servers for the current values. A device switched on the keypad
+// shows its new value at once and is pending until pilight confirms it;
+// nothing waits for that, so several keys go out one after the other.
+// ////////////////////////////////////////////////////////////////////////////
+
+void controlDevice(struct device *dev, const char *value)
+{
+    char Command[256];
+    const char *name;
+    struct server *s = deviceServer(dev, &name);
+
+    if (!s)
+    {
+        printf("Error: no pilight server for %s\n", dev->name);
+        return;
+    }
+    snprintf(Command,sizeof(Command),"{ \"action\": \"control\", \"code\": { \"device\": \"%s\", \"%s\": \"%s\"}}\n",name,dev->valueKey,value);
+    trace(TR_CONTROL, linkOf(s->fd), dev->traceId, strlen(value));
+
+    // switching goes ahead of value requests and the like
+
+    urgentOutput = 1;
+    sendCommand(s->fd,Command);
+    urgentOutput = 0;
+}
+
+void toggleDevice(struct device *dev, const char *value)
+{
+    dev->pendingId = ++controlSeq;
+    dev->pendingAt = nowMicros();
+    snprintf(dev->pendingValue, VALUESIZE, "%s", value);
+    if (verbose)
+        printf("CONTROL #%d %s to %s\n", dev->pendingId, dev->name, value);
+    controlDevice(dev, value);
+
+    // show the new value right away, marked as pending
+
+    translateValue(dev, dev->pendingValue, dev->currentValue);
+    deviceChanged(dev);
+    scheduleControlTimeout();
+}
+
+void requestValues()
+{
+    int i;
+
+    for (i = 0; i < serverCount; i++)
+        sendCommand(servers[i].fd,"{\"action\": \"request values\" }\r\n");
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// keypadInput
+// ////////////////////////////////////////////////////////////////////////////
+// what was typed on the keypad up to #, e.g. pincode, toggle switch or page.
+// A key of a device on the page shown wins over the page of the same number.
+// ////////////////////////////////////////////////////////////////////////////
+
+void keypadInput(struct console *c, const char *line)
+{
+    trace(TR_KEY, linkOf(c->fd), TRACE_NONE, strlen(line));
+
+    // /////////////////////////
+    // pincode
+    // /////////////////////////
+
+
+    if (deviceTable->pin && (strcmp(deviceTable->pin, line) == 0))
+    {
+        printf("PINVALID on %s\n", c->port);
+        trace(TR_PIN, linkOf(c->fd), TRACE_NONE, 0);
+        c->pinValid=1;
+        if (systemState == ST_ALARM)
+        {
+            pinCodeMessage(c,SV_HI,0);   
+
+            if (lastAlarm && lastAlarm->resetValue)
+            {
+                 controlDevice(lastAlarm, lastAlarm->resetValue);
+            }
+        }
+        else
+
+        // /////////////////////////
+        // show toggle keys
+        // /////////////////////////
+
+        {
+            pinCodeMessage(c,SV_LO,0);   
+
+            // show the keys which can be used to toggle switches
+            
+            showKeys(c, 1);
+        }
+    }
+    else
+    {
+
+        // /////////////////////////
+        // toggle Values
+        // /////////////////////////
+
+        int slot = (strlen(line) == 1) ? keySlot(line[0]) : -1;
+
+        if (c->pinValid && (slot >= 0) && (c->keys[c->page][slot] >= 0))
+        {
+            struct device *dev = &deviceTable->devices[c->keys[c->page][slot]];
+            if (dev->toggles[0] && dev->toggles[1])
+            {
+                const char *newValue;
+                const char *oldValue = dev->pendingId ? dev->pendingValue : dev->rawValue;
+
+                // pressed again before pilight answered: from the pending value
+
+                if (strcmp(oldValue,dev->toggles[0])==0)
+                    newValue=dev->toggles[1];
+                else
+                    newValue=dev->toggles[0];
+                
+                if (verbose)
+                    printf("DEVICE %s TOGGLED from %s to %s \n",dev->name,oldValue,newValue);
+                
+                toggleDevice(dev, newValue);
+            }
+        }
+
+        // /////////////////////////
+        // pages: # alone shows the next one, 1# .. 9# that one
+        // /////////////////////////
+
+        else if ((line[0] == '\0') && (c->pageCount > 1))
+            showPage(c, c->page + 1);
+        else if ((strlen(line) == 1) && (line[0] >= '1') && (line[0] - '1' < c->pageCount))
+            showPage(c, line[0] - '1');
+    }
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// protoAccepted
+// ////////////////////////////////////////////////////////////////////////////
+// the sketch has answered "PROTO 2 <baud>" and talks frames from now on
+// ////////////////////////////////////////////////////////////////////////////
+
+void protoAccepted(struct console *c, const char *line)
+{
+    int baud = 0;
+    speed_t speed;
+
+    if (!c->protoNegotiating || (sscanf(line, "PROTO 2 %d", &baud) != 1))
+        return;
+
+    switch (baud)
+    {
+        case 115200: speed = B115200; break;
+        case 230400: speed = B230400; break;
+        default:     speed = B57600;  baud = 57600; break;
+    }
+    printf("Arduino on %s speaks protocol 2 at %d baud\n", c->port, baud);
+
+    // the PROTO line is answered instead of acknowledged
+
+    c->queue.inFlight = c->queue.lines = c->queue.firstLine = 0;
+    c->queue.partial = c->queue.partialLeft = 0;
+    c->queue.acked = 1;
+    cancelTimer(ackTimeout, c);
+
+    set_interface_attribs(c->fd, speed, 0);
+    tcflush(c->fd, TCIFLUSH);
+
+    c->proto = 2;
+    c->queue.framed = 1;
+    c->input.framed = 1;
+    c->protoNegotiating = 0;
+}
+
+void consoleStart(struct console *c);
+
+// ////////////////////////////////////////////////////////////////////////////
+// parseSerialLine
+// ////////////////////////////////////////////////////////////////////////////
+// analyzes a line received from the Arduino and tries to interpret it
+// ////////////////////////////////////////////////////////////////////////////
+
+void parseSerialLine(struct lineBuffer *lb, char *line, int len)
+{
+    struct console *c = lb->console;
+
+    if (verbose)
+        printf("SERIAL %s: %s\n",c->port,line);
+    trace(TR_LINE, linkOf(lb->fd), TRACE_NONE, len);
+
+    // /////////////////////////
+    // Arduino has processed a line
+    // /////////////////////////
+
+    if (strcmp(line,"ACK") == 0)
+    {
+        c->protoNegotiating = 0;        // a sketch that only knows ASCII
+        ackLine(c);
+    }
+    else if (strncmp(line,"PROTO ",6) == 0)
+    {
+        protoAccepted(c, line);
+    }
+    else if (strcmp(line,"READY") == 0)
+    {
+        consoleStart(c);                // booted, at startup or after a reset
+    }
+    else if (strncmp(line,"STATS ",6) == 0)
+    {
+        unsigned int stats[ARDUINO_STATS];
+        if (sscanf(line, "STATS %u %u %u %u %u %u %u", &stats[0], &stats[1], &stats[2], &stats[3],
+                   &stats[4], &stats[5], &stats[6]) == ARDUINO_STATS)
+            arduinoStats(c, stats);
+    }
+    else
+
+    // /////////////////////////
+    // Arduino OFFLINE
+    // /////////////////////////
+
+    if (strstr(line,"OFFLINE"))   // Arduino says it switched backlight off
+    {
+        arduinoOffline(c);
+    }
+    else
+
+    // /////////////////////////
+    // Arduino ONLINE
+    // /////////////////////////
+
+
+    if ( strstr(line,"ONLINE") ) // Arduino says it switched backlight on
+    {
+        c->arduinoState = ST_ONLINE;
+    }
+    else                                    // something else, e.g. pincode or toggle switch
+    {
+        keypadInput(c, line);
+    }
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// parseSerialFrame
+// ////////////////////////////////////////////////////////////////////////////
+// analyzes a protocol 2 frame received from the Arduino. Key events carry a
+// sequence number and are repeated by the sketch until we acknowledge them,
+// a repeated one is only acknowledged again.
+// ////////////////////////////////////////////////////////////////////////////
+
+void parseSerialFrame(struct console *c, int opcode, unsigned char *payload, int len)
+{
+    switch (opcode)
+    {
+        case OP_ACK:
+            ackLine(c);
+            break;
+
+        case OP_NAK:                    // the frame is gone, so is the display content
+            if (verbose)
+                printf("SERIAL %s: NAK\n", c->port);
+            trace(TR_NAK, linkOf(c->fd), TRACE_NONE, 0);
+            ackLine(c);
+            lcdInvalidate(c);
+            break;
+
+        case OP_KEY:
+            if (len < 1)
+                break;
+            sendFrame(c, OP_KEYACK, payload, 1);
+            if (payload[0] == c->lastKeySeq)
+                break;
+            c->lastKeySeq = payload[0];
+            payload[len] = '\0';
+            if (verbose)
+                printf("SERIAL %s: KEY %d %s\n", c->port, payload[0], (char *) payload + 1);
+            keypadInput(c, (char *) payload + 1);
+            break;
+
+        case OP_STATSREPLY:
+            if (len >= 2 * ARDUINO_STATS)
+            {
+                unsigned int stats[ARDUINO_STATS];
+                int i;
+                for (i = 0; i < ARDUINO_STATS; i++)
+                    stats[i] = payload[2*i] | (payload[2*i+1] << 8);
+                arduinoStats(c, stats);
+            }
+            break;
+
+        case OP_ONLINE:
+            if (verbose)
+                printf("SERIAL %s: ONLINE\n", c->port);
+            c->arduinoState = ST_ONLINE;
+            break;
+
+        case OP_OFFLINE:
+            if (verbose)
+                printf("SERIAL %s: OFFLINE\n", c->port);
+            arduinoOffline(c);
+            break;
+
+        default:
+            printf("SERIAL: unknown frame %02x\n", opcode);
+    }
+}
+
+
+// ////////////////////////////////////////////////////////////////////////////
+// skipJson
+// ////////////////////////////////////////////////////////////////////////////
+// skips white space and, if given, the expected character after it.
+// returns NULL if the expected character is not there.
+// ////////////////////////////////////////////////////////////////////////////
+
+const char *skipJson(const char *p, char expected)
+{
+    while ((*p == ' ') || (*p == '\t'))
+        p++;
+    if (!expected)
+        return p;
+    return (*p == expected) ? p + 1 : NULL;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// isMonitoredUpdate
+// ////////////////////////////////////////////////////////////////////////////
+// scans a raw line from pilight without parsing it. Returns 0 only for an
+// update whose "devices" list names none of the devices in the device
+// table - such a line can be dropped without building a JSON tree.
+// Everything else, including anything the scan does not understand, is
+// passed on to the parser. With -T it runs on the reader threads, they hold
+// tableLock for reading and the counters are atomic.
+// ////////////////////////////////////////////////////////////////////////////
+
+int isMonitoredUpdate(struct server *server, const char *line)
+{
+    const char *p;
+
+    // only updates are filtered
+
+    if ( !(p = strstr(line, "\"origin\"")) ||
+         !(p = skipJson(p + strlen("\"origin\""), ':')) ||
+         (strncmp(skipJson(p, 0), "\"update\"", strlen("\"update\"")) != 0) )
+        return 1;
+
+    __atomic_add_fetch(&updatesSeen, 1, __ATOMIC_RELAXED);
+
+    if ( !(p = strstr(line, "\"devices\"")) ||
+         !(p = skipJson(p + strlen("\"devices\""), ':')) ||
+         !(p = skipJson(p, '[')) )
+        return 1;
+
+    // look up every name of the array in the device hash
+
+    while ( (p = skipJson(p, '"')) )
+    {
+        const char *name = p;
+
+        while (*p && (*p != '"'))
+        {
+            if (*p == '\\')        // escaped names are left to the parser
+                return 1;
+            p++;
+        }
+        if (!*p)
+            return 1;
+        if (findDevice(deviceTable, server->name, name, p - name))
+            return 1;
+
+        p = skipJson(p + 1, 0);
+        if (*p == ']')
+        {
+            __atomic_add_fetch(&updatesFiltered, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        if (*p++ != ',')
+            return 1;
+    }
+    return 1;
+}
+
+void serverIdentified(struct server *s);
+
+// ////////////////////////////////////////////////////////////////////////////
+// parseSocketLine / handleSocketMessage
+// ////////////////////////////////////////////////////////////////////////////
+// analyzes a line received from the pilight daemon. With -T the reader
+// thread has parsed it already and only handleSocketMessage() is left for
+// the main loop.
+// ////////////////////////////////////////////////////////////////////////////
+
+void handleSocketMessage(struct server *server, json_t *SocketCom, int len);
+
+void parseSocketLine(struct lineBuffer *lb, char *line, int len)
+{
+    struct server *server = lb->server;
+    json_t *SocketCom = NULL;
+    long long started = nowMicros(), filtered;
+
+    // most of the house traffic is about devices we do not show
+
+    if (!isMonitoredUpdate(server, line))
+    {
+        observe(&stageTime[STAGE_PARSE], nowMicros() - started);
+        trace(TR_FILTERED, linkOf(lb->fd), TRACE_NONE, len);
+        return;
+    }
+    filtered = nowMicros() - started;
+
+    if (verbose)
+    {
+        if (server->name)
+            printf("SOCKET %s: %s\n",server->name,line);
+        else
+            printf("SOCKET: %s\n",line);
+    }
+    trace(TR_LINE, linkOf(lb->fd), TRACE_NONE, len);
+
+    // the whole tree of this message is built in the arena
+
+    arenaActive = 1;
+
+    started = nowMicros();
+    SocketCom = load_json(line);
+    observe(&stageTime[STAGE_PARSE], filtered + nowMicros() - started);
+    started = nowMicros();
+
+    handleSocketMessage(server, SocketCom, len);
+    observe(&stageTime[STAGE_HANDLE], nowMicros() - started);
+
+    // nothing of the message is kept, handleDevice() copies what it needs
+
+    if (SocketCom)
+        json_decref(SocketCom);
+    arenaActive = 0;
+    arenaReset();
+}
+
+void handleSocketMessage(struct server *server, json_t *SocketCom, int len)
+{
+    if ( SocketCom && ( json_typeof(SocketCom) == JSON_OBJECT) )
+    {
+        json_t *myJson;
+
+        // ////////////////////////////////////////////////////////////
+        // The JSON object we have received from the pilight daemon
+        // is the status message which hopefully is "success"
+        // ////////////////////////////////////////////////////////////
+
+        if ( (myJson= json_object_get(SocketCom,"status")) && (json_is_string(myJson)) &&
+             (strstr(json_string_value(myJson),"success") != NULL) && !server->identified )
+            serverIdentified(server);
+
+        // ////////////////////////////////////////////////////////////
+        // The JSON object we have received from the pilight daemon
+        // contains the initial values
+        // ////////////////////////////////////////////////////////////
+
+        if ((myJson = json_object_get(SocketCom,"message")))
+        {
+            if  ( (myJson = json_object_get(SocketCom,"values")) &&
+                  (json_is_array(myJson)) )
+            {
+                    int i;
+                    for(i = 0; i < json_array_size(myJson); i++)
+                    {
+                        json_t *data = json_array_get(myJson, i);
+                        handleDevice(server, data);
+                    }
+
+                    if (!server->valuesSeen)
+                    {
+                        server->valuesSeen = 1;
+                        valuesPending--;
+                    }
+                    if (server->resyncing)
+                    {
+                        printf("pilight %s: resynchronised %lld ms after the connection was lost, %d values changed\n",
+                               server->host, nowMillis() - server->lostAt, server->resyncChanged);
+                        server->resyncing = 0;
+                    }
+            }
+            
+        }
+
+        // ////////////////////////////////////////////////////////////
+        // The JSON object we have received from the pilight daemon
+        // contains an update - we need to check if it is about a device 
+        // that we monitor by cross-checking with the global settings
+        // ////////////////////////////////////////////////////////////
+
+        if ( (myJson = json_object_get(SocketCom,"origin"))  &&
+             (json_is_string(myJson))                        && 
+             (strstr (json_string_value(myJson),"update")) )
+        {
+            if ( (myJson = json_object_get(SocketCom,"devices")) &&
+                 (json_is_array(myJson)))
+            {
+                handleDevice(server, SocketCom);
+            }
+            
+        }
+    }
+    else
+    {
+        parseErrors++;
+        trace(TR_PARSEERR, linkOf(server->fd), TRACE_NONE, len);
+    }
+}
+
+
+// ////////////////////////////////////////////////////////////////////////////
+// linkName
+// ////////////////////////////////////////////////////////////////////////////
+// what to call a link in messages: the serial port or the pilight server
+// ////////////////////////////////////////////////////////////////////////////
+
+const char *linkName(struct lineBuffer *lb)
+{
+    if (lb->console)
+        return lb->console->port;
+    return lb->server->name ? lb->server->name : lb->server->host;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// readInput / readLines
+// ////////////////////////////////////////////////////////////////////////////
+// reads whatever is available into the line buffer and hands every complete
+// line to the handler. Lines are passed in place (newline replaced by \0)
+// and only the partial line at the end is ever moved. A line that does not
+// fit into the buffer at all is dropped up to its newline. With -T a serial
+// port is read by its thread, the bytes are taken from the ring instead.
+// returns length read, 0 on end of file, -1 if there is nothing to read
+// ////////////////////////////////////////////////////////////////////////////
+
+int readThreaded(struct lineBuffer *lb)
+{
+    struct linkThreads *t = lb->threads;
+    int closed = __atomic_load_n(&t->closed, __ATOMIC_SEQ_CST);
+    int rdlen = ringGet(&t->in, lb->data + lb->tail, lb->size - lb->tail);
+
+    linkWake(&t->readerSleeping, t->readerWake);
+    if (rdlen > 0)
+        return rdlen;
+    if (closed)                     // all it read before the end is taken
+        return 0;
+    errno = EAGAIN;
+    return -1;
+}
+
+int readInput (struct lineBuffer *lb)
+{
+    int rdlen;
+
+    // make room by moving the partial line to the front
+
+    if ( (lb->tail == lb->size) && (lb->head > 0) )
+    {
+        memmove(lb->data, lb->data + lb->head, lb->tail - lb->head);
+        lb->tail -= lb->head;
+        lb->scan -= lb->head;
+        lb->head = 0;
+    }
+
+    long long before = nowMicros();
+
+    rdlen = lb->threads ? readThreaded(lb) : read(lb->fd, lb->data + lb->tail, lb->size - lb->tail);
+    if (rdlen <= 0)
+        return(rdlen);
+    inputAt = nowMicros();
+    inputLink = lb;
+    observe(&stageTime[STAGE_READ], inputAt - before);
+    if (lb->threads)                // the latency counts from the read on the thread
+        inputAt = __atomic_load_n(&lb->threads->readAt, __ATOMIC_SEQ_CST);
+    captureTraffic('<', lb->fd, lb->data + lb->tail, rdlen);
+    trace(TR_READ, linkOf(lb->fd), TRACE_NONE, rdlen);
+    lb->tail += rdlen;
+    lb->bytesIn += rdlen;
+    return(rdlen);
+}
+
+int readLines (struct lineBuffer *lb, void (*handler)(struct lineBuffer *lb, char *line, int len))
+{
+    int rdlen;
+    char *nl;
+
+    if ((rdlen = readInput(lb)) <= 0)
+        return(rdlen);
+
+    // only the new bytes need to be searched for a newline. The handler may
+    // switch the link to frames, the rest is left to readFrames() then.
+
+    while ( !lb->framed && (nl = memchr(lb->data + lb->scan, '\n', lb->tail - lb->scan)) )
+    {
+        char *line = lb->data + lb->head;
+        int len = nl - line;
+
+        *nl = '\0';
+        if ( (len > 0) && (line[len-1] == '\r') )
+            line[--len] = '\0';
+
+        if (lb->discarding)
+            lb->discarding = 0;
+        else if ((len > 0) || lb->console)  // an empty line is # on the keypad
+        {
+            long long before = nowMicros();
+
+            lb->linesIn++;
+            handler(lb, line, len);
+            if (lb->console)            // pilight lines time their own stages
+                observe(&stageTime[STAGE_HANDLE], nowMicros() - before);
+        }
+
+        lb->head = lb->scan = (nl + 1) - lb->data;
+    }
+    lb->scan = lb->tail;
+
+    if (lb->head == lb->tail)
+        lb->head = lb->tail = lb->scan = 0;
+
+    // overflow: the buffer is full and holds no complete line
+
+    if ( (lb->head == 0) && (lb->tail == lb->size) )
+    {
+        printf("Error: line longer than %d bytes on %s, dropped\n", lb->size, linkName(lb));
+        lb->overflows++;
+        trace(TR_OVERFLOW, linkOf(lb->fd), TRACE_NONE, lb->size);
+        lb->discarding = 1;
+        lb->head = lb->tail = lb->scan = 0;
+    }
+
+    return(rdlen);
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// readFrames
+// ////////////////////////////////////////////////////////////////////////////
+// the protocol 2 counterpart of readLines. Bytes that do not start a frame
+// with a valid length and CRC are skipped one at a time until the next
+// sync byte, so a lost or garbled byte costs only the frame it was in.
+// A READY among them is an Arduino that was reset and starts in ASCII.
+// ////////////////////////////////////////////////////////////////////////////
+
+int readFrames (struct lineBuffer *lb)
+{
+    static const char ready[] = "READY\n";
+    int rdlen, i;
+
+    if ((rdlen = readInput(lb)) <= 0)
+        return(rdlen);
+
+    for (i = lb->tail - rdlen; i < lb->tail; i++)
+    {
+        if (lb->data[i] == ready[lb->readyMatch])
+            lb->readyMatch++;
+        else
+            lb->readyMatch = (lb->data[i] == ready[0]);
+        if (lb->readyMatch == sizeof(ready) - 1)
         {
-            // now we look into the configured devices and alarms
-            // updatedDevice contains the device name
-            
-            const char *updatedDevice = json_string_value(data);
-            json_t *configNode;
-                
-            if ( configNode= json_object_get(globalDevices,updatedDevice))   // we have configured this device
-                isAlarm=SV_LO;
-            else
-                if ( configNode= json_object_get(globalAlarms,updatedDevice)) // we have it configured as alarm device
-                         isAlarm=SV_HI;
+            consoleReset(lb->console, "READY");
+            return(rdlen);
+        }
+    }
+
+    while (lb->tail - lb->head >= FRAME_OVERHEAD)
+    {
+        unsigned char *frame = (unsigned char *) lb->data + lb->head;
+        int len = frame[1];
+
+        if ( (frame[0] != PROTO_SYNC) || (len > FRAME_MAXPAYLOAD) )
+        {
+            lb->head++;
+            continue;
+        }
+        if (lb->tail - lb->head < len + FRAME_OVERHEAD)
+            break;
+        if (crc8(0, frame + 1, len + 2) != frame[len + 3])
+        {
+            lb->crcErrors++;
+            lb->head++;
+            continue;
+        }
+        long long before = nowMicros();
+
+        lb->linesIn++;
+        parseSerialFrame(lb->console, frame[2], frame + 3, len);
+        observe(&stageTime[STAGE_HANDLE], nowMicros() - before);
+        lb->head += len + FRAME_OVERHEAD;
+    }
+
+    lb->scan = lb->tail;
+    if (lb->head == lb->tail)
+        lb->head = lb->tail = lb->scan = 0;
+
+    return(rdlen);
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// backoffDelay
+// ////////////////////////////////////////////////////////////////////////////
+// the pause before the next attempt to restore a link. It doubles with every
+// failed attempt up to RECONNECT_MAX, plus up to 50% random jitter so that
+// links lost at the same moment do not retry in lockstep.
+// ////////////////////////////////////////////////////////////////////////////
+
+int backoffDelay(int *attempts)
+{
+    int delay = RECONNECT_MIN;
+    int i;
+
+    for (i = 0; (i < *attempts) && (delay < RECONNECT_MAX); i++)
+        delay *= 2;
+    if (delay > RECONNECT_MAX)
+        delay = RECONNECT_MAX;
+    (*attempts)++;
+
+    return delay + random() % (delay / 2 + 1);
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// resetQueue / resetLink
+// ////////////////////////////////////////////////////////////////////////////
+// forgets everything queued for and received from a link that is gone.
+// resetQueue() alone may be used while the input is being parsed.
+// ////////////////////////////////////////////////////////////////////////////
+
+void resetQueue(struct outQueue *q, int fd)
+{
+    struct outQueue qInit = { q->console };
+
+    qInit.fd = fd;
+    qInit.threads = q->threads;
+    qInit.window = q->window;
+    qInit.bytesOut = q->bytesOut;       // counters keep counting
+    qInit.linesOut = q->linesOut;
+    *q = qInit;
+}
+
+void resetLink(struct outQueue *q, struct lineBuffer *lb, int fd)
+{
+    struct lineBuffer lbInit = { lb->console, lb->server, fd, lb->data, lb->size };
+
+    lbInit.overflows = lb->overflows;
+    lbInit.crcErrors = lb->crcErrors;
+    lbInit.bytesIn = lb->bytesIn;
+    lbInit.linesIn = lb->linesIn;
+    lbInit.threads = lb->threads;
+    resetQueue(q, fd);
+    *lb = lbInit;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// linkSleep
+// ////////////////////////////////////////////////////////////////////////////
+// -T: a link thread waits until the main loop has moved *index away from
+// seen, i.e. queued data for a writer or made room for a reader, or until
+// the link is stopped. See ringPut() for the order of flag and index.
+// ////////////////////////////////////////////////////////////////////////////
+
+void linkSleep(struct linkThreads *t, int *sleeping, int wake, unsigned int *index, unsigned int seen)
+{
+    struct pollfd pfd = { wake, POLLIN, 0 };
+    uint64_t count;
+
+    __atomic_store_n(sleeping, 1, __ATOMIC_SEQ_CST);
+    if ( (__atomic_load_n(index, __ATOMIC_SEQ_CST) == seen) && !__atomic_load_n(&t->stop, __ATOMIC_SEQ_CST) )
+        poll(&pfd, 1, -1);
+    __atomic_store_n(sleeping, 0, __ATOMIC_SEQ_CST);
+    read(wake, &count, sizeof(count));
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// readerPush / readerPop
+// ////////////////////////////////////////////////////////////////////////////
+// the ring between a pilight reader thread and the main loop. The reader
+// sleeps while the ring is full, pilight then waits on the socket like it
+// does for a busy main loop without -T. mainWake wakes the main loop from
+// poll(). Returns 0 if the link was stopped meanwhile, the message is
+// dropped then.
+// ////////////////////////////////////////////////////////////////////////////
+
+int readerPush(struct server *s, struct socketMessage *m)
+{
+    struct readerQueue *q = s->readerQueue;
+    struct linkThreads *t = s->threads;
+    unsigned int tail = q->tail;
+    unsigned int head;
+    uint64_t one = 1;
+
+    while (tail - (head = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST)) == READER_QUEUE)
+    {
+        if (__atomic_load_n(&t->stop, __ATOMIC_SEQ_CST))
+        {
+            if (m->json)
+                json_decref(m->json);
+            heapFree(m->line);
+            return 0;
+        }
+        linkSleep(t, &t->readerSleeping, t->readerWake, &q->head, head);
+    }
+    q->slot[tail % READER_QUEUE] = *m;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_SEQ_CST);
+    write(mainWake, &one, sizeof(one));
+    return 1;
+}
+
+int readerPop(struct server *s, struct socketMessage *m)
+{
+    struct readerQueue *q = s->readerQueue;
+    unsigned int head = q->head;
+
+    if (head == __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST))
+        return 0;
+    *m = q->slot[head % READER_QUEUE];
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_SEQ_CST);
+    linkWake(&s->threads->readerSleeping, s->threads->readerWake);
+    return 1;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// readerThread
+// ////////////////////////////////////////////////////////////////////////////
+// -T: reads one pilight connection, from the connect until it is lost. The
+// lines are split in the input buffer of the server like readLines() does,
+// filtered and parsed here, the main loop only gets the JSON. Besides the
+// device table under tableLock the thread touches nothing else of the
+// server, it ends after queueing the loss.
+// ////////////////////////////////////////////////////////////////////////////
+
+void *readerThread(void *arg)
+{
+    struct server *s = arg;
+    struct linkThreads *t = s->threads;
+    struct lineBuffer *lb = &s->input;
+    struct socketMessage m;
+    int rdlen, bytes = 0;
+    uint64_t count;
+    char *nl;
+
+    while (!__atomic_load_n(&t->stop, __ATOMIC_SEQ_CST))
+    {
+        struct pollfd pfd[2] = { { t->readerWake, POLLIN, 0 }, { t->fd, POLLIN, 0 } };
+
+        if ( (lb->tail == lb->size) && (lb->head > 0) )
+        {
+            memmove(lb->data, lb->data + lb->head, lb->tail - lb->head);
+            lb->tail -= lb->head;
+            lb->scan -= lb->head;
+            lb->head = 0;
+        }
 
-            if ( configNode)
+        poll(pfd, 2, -1);
+        if (pfd[0].revents & POLLIN)
+            read(t->readerWake, &count, sizeof(count));
+        if (!(pfd[1].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+        rdlen = read(t->fd, lb->data + lb->tail, lb->size - lb->tail);
+        if ( (rdlen == 0) || ((rdlen < 0) && (errno != EAGAIN) && (errno != EINTR)) )
+            break;
+        if (rdlen < 0)
+            continue;
+        lb->tail += rdlen;
+        bytes += rdlen;
+
+        while ( (nl = memchr(lb->data + lb->scan, '\n', lb->tail - lb->scan)) )
+        {
+            char *line = lb->data + lb->head;
+            int len = nl - line;
+
+            *nl = '\0';
+            if ( (len > 0) && (line[len-1] == '\r') )
+                line[--len] = '\0';
+
+            if (lb->discarding)
+                lb->discarding = 0;
+            else if (len > 0)
             {
-                // read out the value of the device from the values node of the incoming message
-                
-                json_t *newValues = json_object_get(updateMessage,"values");
-                int lineNumber =0;
-                if (!isAlarm) 
-                    lineNumber= json_integer_value(json_object_get(configNode,"line"));
-                const char *friendlyName = json_string_value(json_object_get(configNode,"friendlyname"));
-                
-                // find the key we are interested in from the value node of the configured device
-                
-                const char *valueKey = json_string_value(json_object_get(configNode,"value")); 
-                json_t *theValue = json_object_get(newValues,valueKey);
-                
-                char theStringValue[30];
-                json_t *translateValue  = NULL;
-                json_t *translatedValue = NULL;
-                
-                // we might want to translate it, hence see if there is a translate node in the config
-                
-                if (translateValue = json_object_get(configNode,"translate"))
+                memset(&m, 0, sizeof(m));
+                m.readAt = nowMicros();
+                pthread_rwlock_rdlock(&tableLock);
+                m.filtered = !isMonitoredUpdate(s, line);
+                pthread_rwlock_unlock(&tableLock);
+                if (!m.filtered)
+                    m.json = load_json(line);
+                m.parseTime = nowMicros() - m.readAt;
+                m.length = len;
+                m.bytes = bytes;
+                bytes = 0;
+                if ((verbose && !m.filtered) || captureFile)
                 {
-                   if (translatedValue =  json_object_get(translateValue,json_string_value(theValue)))
-                    {
-                        theValue = translatedValue;
-                    }
+                    m.line = heapAlloc(len + 1);
+                    memcpy(m.line, line, len + 1);
                 }
+                if (!readerPush(s, &m))
+                    return NULL;
+            }
+            lb->head = lb->scan = (nl + 1) - lb->data;
+        }
+        lb->scan = lb->tail;
 
-                // depending on the type of the field we need to do some formatting (temperature is real, on/off is string etc.)
+        if (lb->head == lb->tail)
+            lb->head = lb->tail = lb->scan = 0;
+        if ( (lb->head == 0) && (lb->tail == lb->size) )
+        {
+            printf("Error: line longer than %d bytes on %s, dropped\n", lb->size, linkName(lb));
+            __atomic_add_fetch(&lb->overflows, 1, __ATOMIC_RELAXED);   // the stats read it
+            lb->discarding = 1;
+            lb->head = lb->tail = lb->scan = 0;
+        }
+    }
 
-                switch (json_typeof(theValue)) 
-                {
-                    case JSON_REAL:
-                        sprintf(theStringValue,"%4.1f",json_real_value(theValue));
-                        break;
-                    case JSON_INTEGER:
-                        sprintf(theStringValue,"%d",json_integer_value(theValue));
-                        break;
-                    case JSON_STRING:
-                        sprintf(theStringValue,"%s",json_string_value(theValue));
-                        break;
-                }        
-                //printf ("%d : %s : %s = %s\n", lineNumber, friendlyName, valueKey , theStringValue);
-                    
-                // for alarm codes we have defined triggervalue and resetvalue, i.e.
-                // if the device goes to state triggervalue then we have an alarm.
-                // in order to reset it we need to compare to resetvalue
+    memset(&m, 0, sizeof(m));
+    m.length = -1;
+    m.bytes = bytes;
+    readerPush(s, &m);
+    return NULL;
+}
 
-            
-                const char *springValue = json_string_value(json_object_get(configNode,"triggervalue"));
-                const char *resetValue  = json_string_value(json_object_get(configNode,"resetvalue"));
+// ////////////////////////////////////////////////////////////////////////////
+// serialReader / linkWriter
+// ////////////////////////////////////////////////////////////////////////////
+// -T: the other link threads. serialReader() copies what the Arduino sends
+// into the input ring, readInput() takes it from there. linkWriter() writes
+// what flushQueue() put into the output ring, to a serial port or a pilight
+// connection. A write error ends the writer, the reader then sees the link
+// go down.
+// ////////////////////////////////////////////////////////////////////////////
+
+void *serialReader(void *arg)
+{
+    struct linkThreads *t = arg;
+    struct byteRing *r = &t->in;
+    char buffer[LINK_RING];
+    uint64_t one = 1, count;
+
+    while (!__atomic_load_n(&t->stop, __ATOMIC_SEQ_CST))
+    {
+        struct pollfd pfd[2] = { { t->readerWake, POLLIN, 0 }, { t->fd, POLLIN, 0 } };
+        unsigned int head = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+        unsigned int room = LINK_RING - (r->tail - head);
+        int rdlen;
+
+        if (room == 0)              // the main loop is behind
+        {
+            linkSleep(t, &t->readerSleeping, t->readerWake, &r->head, head);
+            continue;
+        }
+
+        poll(pfd, 2, -1);
+        if (pfd[0].revents & POLLIN)
+            read(t->readerWake, &count, sizeof(count));
+        if (!(pfd[1].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+        rdlen = read(t->fd, buffer, room);
+        if ( (rdlen < 0) && ((errno == EAGAIN) || (errno == EINTR)) )
+            continue;
+        __atomic_store_n(&t->readAt, nowMicros(), __ATOMIC_SEQ_CST);
+        if (rdlen <= 0)
+        {
+            __atomic_store_n(&t->closed, 1, __ATOMIC_SEQ_CST);
+            write(mainWake, &one, sizeof(one));
+            break;
+        }
+        ringPut(r, buffer, rdlen);
+        write(mainWake, &one, sizeof(one));
+    }
+    return NULL;
+}
+
+void *linkWriter(void *arg)
+{
+    struct linkThreads *t = arg;
+    struct byteRing *r = &t->out;
+    uint64_t one = 1, count;
+
+    while (!__atomic_load_n(&t->stop, __ATOMIC_SEQ_CST))
+    {
+        struct pollfd pfd[2] = { { t->writerWake, POLLIN, 0 }, { t->fd, POLLOUT, 0 } };
+        unsigned int head = r->head;
+        unsigned int len = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) - head;
+        int wlen;
+
+        if (len == 0)
+        {
+            linkSleep(t, &t->writerSleeping, t->writerWake, &r->tail, head);
+            continue;
+        }
+
+        // up to the end of the ring, the rest follows in the next round
+
+        if (len > LINK_RING - head % LINK_RING)
+            len = LINK_RING - head % LINK_RING;
+        wlen = write(t->fd, r->data + head % LINK_RING, len);
+        if (wlen < 0)
+        {
+            if ( (errno != EAGAIN) && (errno != EINTR) )
+                break;
+            poll(pfd, 2, -1);
+            if (pfd[0].revents & POLLIN)
+                read(t->writerWake, &count, sizeof(count));
+            continue;
+        }
+        __atomic_store_n(&r->head, head + wlen, __ATOMIC_SEQ_CST);
+        if (__atomic_exchange_n(&t->outFull, 0, __ATOMIC_SEQ_CST))
+            write(mainWake, &one, sizeof(one));
+    }
+    return NULL;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// linkThreadsStart / linkThreadsStop
+// ////////////////////////////////////////////////////////////////////////////
+// -T: the threads live from the connect or open of a link until it is lost.
+// They are stopped and joined before the descriptor is closed, what is
+// still in the rings belongs to the old connection and is dropped.
+// ////////////////////////////////////////////////////////////////////////////
+
+void linkThreadsStart(struct linkThreads *t, int fd, void *(*reader)(void *), void *arg)
+{
+    uint64_t count;
+
+    t->fd = fd;
+    t->stop = t->closed = t->outFull = 0;
+    t->readerSleeping = t->writerSleeping = 0;
+    t->in.head = t->in.tail = t->out.head = t->out.tail = 0;
+    read(t->readerWake, &count, sizeof(count));
+    read(t->writerWake, &count, sizeof(count));
+
+    if ( pthread_create(&t->reader, NULL, reader, arg) ||
+         pthread_create(&t->writer, NULL, linkWriter, t) )
+    {
+        printf("Error: no threads for link %d\n", fd);
+        exit(1);
+    }
+    t->running = 1;
+}
+
+void linkThreadsStop(struct linkThreads *t)
+{
+    uint64_t one = 1;
+
+    if (!t || !t->running)
+        return;
+    __atomic_store_n(&t->stop, 1, __ATOMIC_SEQ_CST);
+    write(t->readerWake, &one, sizeof(one));
+    write(t->writerWake, &one, sizeof(one));
+    pthread_join(t->reader, NULL);
+    pthread_join(t->writer, NULL);
+    t->running = 0;
+}
+
+struct linkThreads *linkThreadsCreate()
+{
+    struct linkThreads *t = heapAlloc(sizeof(struct linkThreads));
+
+    memset(t, 0, sizeof(struct linkThreads));
+    t->fd = -1;
+    if ( ((t->readerWake = eventfd(0, EFD_NONBLOCK)) < 0) ||
+         ((t->writerWake = eventfd(0, EFD_NONBLOCK)) < 0) )
+    {
+        printf("Error creating eventfd: %s\n", strerror(errno));
+        exit(1);
+    }
+    return t;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// readerDrain
+// ////////////////////////////////////////////////////////////////////////////
+// -T: the main loop's side. Hands the queued messages of all servers to
+// handleSocketMessage() with the same accounting as parseSocketLine(),
+// reads what the serial readers got like pollHandle() does without threads,
+// and hands the writers what did not fit before. A link whose reader has
+// ended is taken down.
+// ////////////////////////////////////////////////////////////////////////////
+
+void serverLost(struct server *s);
+void pollHandle (struct pollfd *pfd, struct lineBuffer *lb, void (*handler)(struct lineBuffer *lb, char *line, int len));
+void parseSerialLine(struct lineBuffer *lb, char *line, int len);
+
+void readerDrain()
+{
+    struct socketMessage m;
+    uint64_t count;
+    int i;
+
+    read(mainWake, &count, sizeof(count));
+
+    for (i = 0; i < serverCount; i++)
+    {
+        struct server *s = &servers[i];
+
+        while (s->readerQueue && readerPop(s, &m))
+        {
+            s->input.bytesIn += m.bytes;
+            if (m.bytes)
+                trace(TR_READ, linkOf(s->fd), TRACE_NONE, m.bytes);
+            if (m.length < 0)
+            {
+                serverLost(s);
+                break;
+            }
+
+            inputAt = m.readAt;
+            inputLink = &s->input;
+            s->input.linesIn++;
+            observe(&stageTime[STAGE_PARSE], m.parseTime);
+            trace(m.filtered ? TR_FILTERED : TR_LINE, linkOf(s->fd), TRACE_NONE, m.length);
+            if (m.line)
+            {
+                m.line[m.length] = '\n';
+                captureTraffic('<', s->fd, m.line, m.length + 1);
+                m.line[m.length] = '\0';
+                if (verbose && !m.filtered && s->name)
+                    printf("SOCKET %s: %s\n",s->name,m.line);
+                else if (verbose && !m.filtered)
+                    printf("SOCKET: %s\n",m.line);
+                heapFree(m.line);
+            }
+            if (m.filtered)
+                continue;
+
+            long long started = nowMicros();
+
+            handleSocketMessage(s, m.json, m.length);
+            observe(&stageTime[STAGE_HANDLE], nowMicros() - started);
+            if (m.json)
+                json_decref(m.json);
+        }
+    }
+
+    // the serial readers, until their rings are empty as mainWake only
+    // comes again with new bytes. pollHandle() flushes the displays.
+
+    for (i = 0; i < consoleCount; i++)
+    {
+        struct console *c = &consoles[i];
+        struct pollfd pfd = { c->fd, POLLIN, POLLIN };
+
+        while ( c->threads && c->threads->running &&
+                (ringUsed(&c->threads->in) || __atomic_load_n(&c->threads->closed, __ATOMIC_SEQ_CST)) )
+            pollHandle(&pfd, &c->input, parseSerialLine);
+    }
+
+    // room in the output rings again
+
+    for (i = 0; i < serverCount; i++)
+        flushQueue(&servers[i].queue);
+    for (i = 0; i < consoleCount; i++)
+        flushQueue(&consoles[i].queue);
+
+    // send whatever changed on the displays
+
+    for (i = 0; i < consoleCount; i++)
+        lcdFlush(&consoles[i]);
+    inputAt = 0;
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// serverConnect / serverIdentify / serverIdentified / serverLost
+// ////////////////////////////////////////////////////////////////////////////
+// the life of a pilight connection. serverConnect() and serverIdentify() are
+// timer callbacks: the first retries with backoff until a connect could be
+// started, the second repeats identify until pilight answers. After a lost
+// connection the values are requested again. They only repaint what changed,
+// the display shadow takes care of that.
+// ////////////////////////////////////////////////////////////////////////////
+
+void serverIdentify(void *arg)
+{
+    struct server *s = arg;
+    char Command[256];
+
+    if ((s->fd < 0) || s->identified)
+        return;
+
+    printf("Waiting for registration with Pilight %s\n", s->host);
+    snprintf(Command, sizeof(Command), "{\"action\": \"identify\", \"options\": { \"core\": 0, \"receiver\": 0, \"config\": 1, \"forward\": 0 }, \"uuid\": \"%s\", \"media\": \"all\" }\r\n", s->uuid);
+    sendCommand(s->fd, Command);
+    scheduleTimer(serverIdentify, s, IDENTIFY_TIMEOUT);
+}
+
+void serverConnect(void *arg)
+{
+    struct server *s = arg;
+
+    printf ("opening %s:%d ...\n",s->host, s->port);
+    if ((s->fd = socket_connect((char *) s->host, s->port)) < 0)
+    {
+        scheduleTimer(serverConnect, s, backoffDelay(&s->attempts));
+        return;
+    }
+    resetLink(&s->queue, &s->input, s->fd);
+    if (s->threads)
+        linkThreadsStart(s->threads, s->fd, readerThread, s);
+    serverIdentify(s);
+}
+
+void serverIdentified(struct server *s)
+{
+    printf("registered with pilight %s\n", s->host);
+    trace(TR_UP, linkOf(s->fd), TRACE_NONE, 0);
+    s->identified = 1;
+    s->attempts = 0;
+    cancelTimer(serverIdentify, s);
+
+    sendCommand(s->fd,"{\"action\": \"request values\" }\r\n");
+}
+
+void serverLost(struct server *s)
+{
+    int delay = backoffDelay(&s->attempts);
+
+    printf("Error: pilight %s connection lost, retry in %d ms\n", s->host, delay);
+    trace(TR_DOWN, linkOf(s->fd), TRACE_NONE, 0);
+    linkThreadsStop(s->threads);
+    close(s->fd);
+    s->fd = -1;
+    resetLink(&s->queue, &s->input, -1);
+    s->identified = 0;
+    cancelTimer(serverIdentify, s);
+    if (s->valuesSeen && !s->resyncing)
+    {
+        s->lostAt = nowMillis();
+        s->resyncing = 1;
+        s->resyncChanged = 0;
+    }
+    scheduleTimer(serverConnect, s, delay);
+}
+
+// ////////////////////////////////////////////////////////////////////////////
+// consoleOpen / consoleStart / consoleReady / protoTimeout / consoleLost
+// ////////////////////////////////////////////////////////////////////////////
+// the same for a serial port, at startup and e.g. when the USB serial
+// adapter was re-enumerated. Opening the port resets the Arduino, so the
+// console is only used once the sketch says READY, or after ARDUINO_BOOT for
+// sketches that do not. It starts over in ASCII, offers protocol 2 and then
+// gets the whole frame painted.
+// ////////////////////////////////////////////////////////////////////////////
+
+void protoTimeout(void *arg)
+{
+    struct console *c = arg;
+
+    if (!c->protoNegotiating)
+        return;
+    printf("Arduino on %s speaks ASCII only\n", c->port);
+    c->protoNegotiating = 0;
+}
+
+void consoleReady(void *arg);
+
+void consoleStart(struct console *c)
+{
+    printf("console %s ready after %lld ms\n", c->port, nowMillis() - c->lostAt);
+    trace(TR_UP, linkOf(c->fd), TRACE_NONE, 0);
+    cancelTimer(consoleReady, c);
+    resetQueue(&c->queue, c->fd);
+    c->ready = 1;
+    c->attempts = 0;
+
+    // a sketch that reset on its own (brown-out) comes back locked, the PIN
+    // has to be entered again
+
+    arduinoOffline(c);
+
+    if (consoleSetting(c, "protocol") != 1)
+    {
+        char Command[32];
+        int baud = consoleSetting(c, "baudrate");
+
+        snprintf(Command, sizeof(Command), "PROTO 2 %d\n", baud ? baud : 57600);
+        c->protoNegotiating = 1;
+        sendCommand(c->fd, Command);
+        scheduleTimer(protoTimeout, c, PROTO_TIMEOUT);
+    }
+
+    lcdInvalidate(c);
+    c->lcdCleared = 1;              // the display is blank after the reset
+}
+
+void consoleReady(void *arg)
+{
+    struct console *c = arg;
+
+    // whatever the sketch sent while booting is of no interest
+
+    tcflush(c->fd, TCIFLUSH);
+    if (c->threads)                 // what its reader already took, too
+        __atomic_store_n(&c->threads->in.head, __atomic_load_n(&c->threads->in.tail, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    resetLink(&c->queue, &c->input, c->fd);
+    consoleStart(c);
+}
+
+void consoleOpen(void *arg)
+{
+    struct console *c = arg;
+
+    printf ("opening %s ...\n",c->port);
+    if ((c->fd = open(c->port, O_RDWR | O_NOCTTY | O_SYNC | O_NONBLOCK)) < 0)
+    {
+        int delay = backoffDelay(&c->attempts);
+
+        printf("Error opening %s: %s, retry in %d ms\n", c->port, strerror(errno), delay);
+        scheduleTimer(consoleOpen, c, delay);
+        return;
+    }
+    set_interface_attribs(c->fd, B57600, 0);
+    resetLink(&c->queue, &c->input, c->fd);
+    if (c->threads)
+        linkThreadsStart(c->threads, c->fd, serialReader, c->threads);
+    scheduleTimer(consoleReady, c, ARDUINO_BOOT);
+}
 
-                char theLine[40];
-                bzero(theLine,40);
+void consoleLost(struct console *c)
+{
+    int delay = backoffDelay(&c->attempts);
+
+    printf("Error: %s lost, retry in %d ms\n", c->port, delay);
+    trace(TR_DOWN, linkOf(c->fd), TRACE_NONE, 0);
+    linkThreadsStop(c->threads);
+    close(c->fd);
+    c->fd = -1;
+    resetLink(&c->queue, &c->input, -1);
+    cancelTimer(ackTimeout, c);
+    cancelTimer(consoleReady, c);
+    cancelTimer(protoTimeout, c);
+    c->ready = 0;
+    c->proto = 1;
+    c->protoNegotiating = 0;
+    c->lastKeySeq = -1;
+    c->ackMisses = 0;
+    c->lostAt = nowMillis();
+
+    // the Arduino is reset on reopen, the PIN has to be entered again
+
+    arduinoOffline(c);
+    scheduleTimer(consoleOpen, c, delay);
+}
 
-                // Case 1 : We have received "Alarm on" code
+// ////////////////////////////////////////////////////////////////////////////
+// consoleReset
+// ////////////////////////////////////////////////////////////////////////////
+// the Arduino restarted on its own (brown-out, USB replug) while the link
+// talked frames, maybe at another speed. The port is reopened at the base
+// speed like after a lost link, and the handshake starts over.
+// ////////////////////////////////////////////////////////////////////////////
 
-                if  (isAlarm && (strstr(theStringValue,springValue))) 
-                {
-                    systemState=ST_ALARM;
-                    pinCodeMessage(isAlarm,1);   
-                    sprintf (theLine,"MESSAGE %d 0 %d %s !!!", isAlarm, lineNumber, friendlyName);
-                    lastAlarm = configNode;
-                }
+void consoleReset(struct console *c, const char *why)
+{
+    printf("Error: Arduino on %s was reset (%s)\n", c->port, why);
+    consoleLost(c);
+}
 
-                // Case 2 : We have received "Alarm off" code
+// ////////////////////////////////////////////////////////////////////////////
+// pollHandle
+// ////////////////////////////////////////////////////////////////////////////
+// reads from a descriptor that poll() reported as readable. A hangup or EOF
+// means the peer (pilight or the USB serial adapter) is gone, the link is
+// closed and restored in the background.
+// ////////////////////////////////////////////////////////////////////////////
 
-                if (isAlarm && (strstr(theStringValue,resetValue)) && (systemState == ST_ALARM)) 
-                {
-                    systemState=ST_NOALARM;
-                    lastAlarm=NULL;
-                    pinCodeMessage(isAlarm,1);   
-                    sprintf (theLine,"MESSAGE %d 0 %d %s: %s", isAlarm-1, lineNumber, friendlyName, theStringValue);
-                    sendCommand  (tcpfd,"{\"action\": \"request values\" }\r\n");
-                }
-                    
-                // Case 3 : We have received a non-Alarm code
+void pollHandle (struct pollfd *pfd, struct lineBuffer *lb, void (*handler)(struct lineBuffer *lb, char *line, int len))
+{
+    int rdlen, i;
 
-                if   (!isAlarm)
-                {
-                    json_object_set(configNode, "currentvalue", json_string(theStringValue));
-                    if (systemState != ST_ALARM) 
-                    {                        
-                        pinCodeMessage(isAlarm,0);   
-                        sprintf (theLine,"MESSAGE %d 0 %d %s: %s", isAlarm, lineNumber, friendlyName, theStringValue);
-                    }
-                    
-                }
+    if (!(pfd->revents & (POLLIN | POLLHUP | POLLERR)))
+        return;
 
-                // We only print if the line is not empty
-                
-                if (strlen(theLine)>0)
-                {
+    rdlen = lb->framed ? readFrames(lb) : readLines(lb, handler);
 
-                    // Fill the line with spaces until LCDWIDTH in order to have clean printing on the display
-                     
-                    int j;
-                    for (j=strlen(theLine);j<(LCDWIDTH+strlen("MESSAGE 0 0 1 "));j++)
-                        theLine[j]=' ';
-                    theLine[LCDWIDTH+strlen("MESSAGE 0 0 1 ")]='\n';
-                    theLine[LCDWIDTH+strlen("MESSAGE 0 0 1 ")+1]='\0';
-                    sendCommand (serfd, theLine);
-                }
-                
-                // we are done with json objects here
-                
-                //json_decref(translateValue); // borrowed reference
-                //json_decref(newValues); // borrowed reference
-                //json_decref(theValue); // borrowed reference
-                // json_decref(configNode); // borrowed reference
-            }
-        }
-        // json_decref(data); //borrowed reference
+    if ( (rdlen == 0) || ((rdlen < 0) && (errno != EAGAIN) && (errno != EINTR)) )
+    {
+        if (lb->console)
+            consoleLost(lb->console);
+        else
+            serverLost(lb->server);
+        return;
     }
-    // json_decref(myJson); //borrowed reference
-    
+
+    // send whatever changed on the displays
+
+    for (i = 0; i < consoleCount; i++)
+        lcdFlush(&consoles[i]);
+    inputAt = 0;
 }
 
+// ////////////////////////////////////////////////////////////////////////////
+// freeDeviceTable
+// ////////////////////////////////////////////////////////////////////////////
+
+void freeDeviceTable(struct deviceTable *table)
+{
+    heapFree(table->devices);
+    heapFree(table->pool);
+    heapFree(table->hash);
+    heapFree(table);
+}
 
 // ////////////////////////////////////////////////////////////////////////////
-// parseStrings
+// reloadConfig
 // ////////////////////////////////////////////////////////////////////////////
-// analyzes received string values and tries to interpret them
+// reads the config again on SIGHUP or when the file was changed. The new
+// device table is built next to the old one and takes over only if the file
+// could be read, between two events. Values, PIN sessions and the alarm
+// state are kept, and as the pages are drawn into the frame buffers again,
+// only what changed on a display is sent.
+// The links (consoles, pilight servers, stats, trace) keep the settings they
+// were started with, a console takes the layout of the entry at the same
+// position in "consoles".
 // ////////////////////////////////////////////////////////////////////////////
 
+void reloadConfig(void *arg)
+{
+    struct deviceTable *old = deviceTable;
+    struct deviceTable *table;
+    json_t *config = NULL;
+    json_t *list;
+    char *text;
+    int missing = 0;
+    int i, c;
+
+    if ((text = ReadFile(configPath)))
+        config = load_json(text);
+    if (!json_is_object(config))
+    {
+        printf("Error: %s could not be read, the config is not reloaded\n", configPath);
+        if (config)
+            json_decref(config);
+        heapFree(text);
+        return;
+    }
+    table = compileConfig(config, strlen(text));
+    heapFree(text);
+
+    // the values and the alarm carry over by name, the value is translated
+    // again in case the translations changed
 
+    for (i = 0; i < table->count; i++)
+    {
+        struct device *dev = &table->devices[i];
+        struct device *was = findDevice(old, NULL, dev->name, strlen(dev->name));
 
-void parseStrings()
-{
+        if (!was)
+        {
+            missing++;
+            continue;
+        }
+        strcpy(dev->rawValue, was->rawValue);
+        translateValue(dev, dev->rawValue, dev->currentValue);
 
-    char* tokenizedString;  // We might receive multiple lines and need to tokenize 
+        // a pending control action stays pending
+
+        if (was->pendingId && !dev->isAlarm)
+        {
+            dev->pendingId = was->pendingId;
+            dev->pendingAt = was->pendingAt;
+            strcpy(dev->pendingValue, was->pendingValue);
+            translateValue(dev, dev->pendingValue, dev->currentValue);
+        }
+    }
+    if (lastAlarm)
+    {
+        const char *name = lastAlarm->name;
 
+        // an alarm that is gone cannot be reset any more, it ends here
 
-    // //////////////////////////////////////////////
-    // werte Eingabe vom Arduino aus
-    // //////////////////////////////////////////////
-    
+        if (!(lastAlarm = findDevice(table, NULL, name, strlen(name))) && (systemState == ST_ALARM))
+        {
+            printf("alarm %s is no longer in the config, the alarm display ends\n", name);
+            systemState = ST_NOALARM;
+        }
+    }
+
+    // swap. The tree of the start stays, the links point into it. Once the
+    // lock was taken no reader thread looks at the old table any more.
 
-    if (strchr(serialString,'\n'))
+    pthread_rwlock_wrlock(&tableLock);
+    deviceTable = table;
+    pthread_rwlock_unlock(&tableLock);
+    if (globalConfig != startupConfig)
+        json_decref(globalConfig);
+    globalConfig = config;
+
+    // the pages are painted again from the table, the frame diff leaves
+    // what looks the same
+
+    list = json_object_get(globalConfig, "consoles");
+    for (c = 0; c < consoleCount; c++)
     {
+        struct console *con = &consoles[c];
 
-        tokenizedString = strtok(serialString,"\n");
-        
-        while (tokenizedString != NULL)
+        con->config = json_array_size(list) ? json_array_get(list, c) : globalConfig;
+        if (!con->config)
         {
+            printf("console %s is no longer in the config, it stays until the next start\n", con->port);
+            con->config = globalConfig;
+        }
+        heapFree(con->layout);
+        layoutConsole(con);
+        paintPage(con);
+    }
+    freeDeviceTable(old);
 
-            printf("SERIAL: %s\n",tokenizedString);
-        
-            char Command[100];
-            bzero(Command,100);
-            const char *key;
-            json_t *value;
-            
-            // /////////////////////////
-            // Arduino OFFLINE
-            // /////////////////////////
-        
-            if (strstr(tokenizedString,"OFFLINE"))   // Arduino says it switched backlight off
-            {
-                arduinoState = ST_OFFLINE;
-                if (pinValid)
-                {
-                    // /////////////////////////
-                    // erase toggle keys
-                    // /////////////////////////
-
-                    json_object_foreach(globalDevices, key, value)
-                    {                  
-                        const char *theKey = json_string_value(json_object_get(value,"key"));
-                        int theLine = json_integer_value(json_object_get(value,"line"));
-                        if (theKey)
-                        {
-                            sprintf(Command,"MESSAGE 0 %d %d  \n",LCDWIDTH-1,theLine);
-                            sendCommand(serfd,Command);    
-                        }
-                    }
-                    pinValid=0;
-                    pinCodeMessage(SV_LO,0);   
-                }
-            }
-            else
+    checkDeviceServers();
+    traceDevices();
+    printf("config reloaded, %d devices and alarms\n", table->count);
 
-            // /////////////////////////
-            // Arduino ONLINE
-            // /////////////////////////
+    // new devices get their values from pilight
 
+    if (missing)
+        requestValues();
+}
 
-            if ( strstr(tokenizedString,"ONLINE") ) // Arduino says it switched backlight on
-            {
-                arduinoState = ST_ONLINE;
-            }
-            else                                    // something else, e.g. pincode or toggle switch
-            {
-                int i=strlen(tokenizedString);
+// ////////////////////////////////////////////////////////////////////////////
+// onSigHup / watchConfig / configChanged
+// ////////////////////////////////////////////////////////////////////////////
+// a reload is asked for with SIGHUP or by saving the config. The signal
+// handler writes a byte into signalPipe, so a SIGHUP that arrives just
+// before poll() does not wait for the next event. Editors write
+// a file in several steps, so the reload waits until the file stayed the
+// same for RELOAD_DELAY. The directory is watched as editors often replace
+// the file instead of writing it.
+// ////////////////////////////////////////////////////////////////////////////
 
-                // /////////////////////////
-                // pincode
-                // /////////////////////////
+void onSigHup(int sig)
+{
+    int saved = errno;
 
+    reloadRequested = 1;
+    write(signalPipe[1], "", 1);
+    errno = saved;
+}
 
-                const char *pinCode = json_string_value(json_object_get(globalConfig,"pin"));
-                if (strcmp(pinCode, tokenizedString) == 0)
-                {
-                    printf("PINVALID\n");
-                    pinValid=1;
-                    if (systemState == ST_ALARM)
-                    {
-                        pinCodeMessage(SV_HI,0);   
-       
-                        json_object_foreach(globalAlarms, key, value) 
-                        if (value == lastAlarm)
-                        {
-                             sprintf(Command,"{ \"action\": \"control\", \"code\": { \"device\": \"%s\", \"%s\": \"%s\"}}\n",(char *) key,(char *) json_string_value(json_object_get(lastAlarm,"value")), (char *) json_string_value(json_object_get(lastAlarm,"resetvalue")) );
-                             sendCommand(tcpfd,Command);
-                             
-                        }
-                    }
-                    else
+void watchConfig()
+{
+    char path[256];
 
-                    // /////////////////////////
-                    // show toggle keys
-                    // /////////////////////////
+    snprintf(path, sizeof(path), "%s", configPath);
+    if ((inotifyFd = inotify_init1(IN_NONBLOCK)) < 0)
+        return;
+    if (inotify_add_watch(inotifyFd, dirname(path), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        printf("Error: cannot watch %s: %s\n", path, strerror(errno));
+        close(inotifyFd);
+        inotifyFd = -1;
+    }
+}
 
-                    {
-                        pinCodeMessage(SV_LO,0);   
-
-                        // show the keys which can be used to toggle switches
-                        
-                        json_object_foreach(globalDevices, key, value)
-                        {
-                        
-                            const char *theKey = json_string_value(json_object_get(value,"key"));
-                            int theLine = json_integer_value(json_object_get(value,"line"));
-                            if (theKey)
-                            {
-                                sprintf(Command,"MESSAGE 0 %d %d %s\n",LCDWIDTH-1,theLine,theKey);
-                                sendCommand(serfd,Command);    
-                            }
-                        }
-                    }
-                }
-                else
-                {
- 
-                    // /////////////////////////
-                    // toggle Values
-                    // /////////////////////////
- 
-                    if (pinValid)
-                    json_object_foreach(globalDevices, key, value)
-                    {
-                        const char *theKey = json_string_value(json_object_get(value,"key"));
-                        if ( (theKey) &&  (strcmp(theKey, tokenizedString) == 0) )
-                        {
-                            json_t *toggleValues = json_object_get(value,"toggles");
-                            const char *toggleValue1 = json_string_value(json_array_get(toggleValues,0));
-                            const char *toggleValue2 = json_string_value(json_array_get(toggleValues,1));
-                            const char *currentValue = json_string_value(json_object_get(value,"currentvalue"));
-                            
-                            const char *tkey;
-                            json_t *tvalue;
-                            
-                            json_object_foreach(json_object_get(value,"translate"), tkey, tvalue)
-                            {
-                                if (strcmp(currentValue,json_string_value(tvalue))==0) 
-                                    currentValue = tkey;
-                            }
-                            
-                            if (strcmp(currentValue,toggleValue1)==0)
-                                tkey=toggleValue2;
-                            else
-                                tkey=toggleValue1;
-                            
-                            
-                            printf("DEVICE %s TOGGLED from %s to %s \n",key,currentValue, tkey);
-                            
-                            sprintf(Command,"{ \"action\": \"control\", \"code\": { \"device\": \"%s\", \"%s\": \"%s\"}}\n",(char *) key,(char *) json_string_value(json_object_get(value,"value")), tkey );
-                            sendCommand(tcpfd,Command);
-                            
-                            
-                        }
-                    }
-                    
-                }
-            }
+void configChanged()
+{
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    char path[256];
+    const char *name;
+    int len, pos;
 
-                
+    snprintf(path, sizeof(path), "%s", configPath);
+    name = basename(path);
 
+    while ((len = read(inotifyFd, buffer, sizeof(buffer))) > 0)
+        for (pos = 0; pos < len; pos += sizeof(struct inotify_event) + ((struct inotify_event *) (buffer + pos))->len)
+        {
+            struct inotify_event *event = (struct inotify_event *) (buffer + pos);
 
-            tokenizedString = strtok(NULL,"\n");
+            if (event->len && (strcmp(event->name, name) == 0))
+                scheduleTimer(reloadConfig, NULL, RELOAD_DELAY);
         }
-        free (serialString);
-        serialString = (char *) malloc(1);
-        serialString[0]='\0';
-    }
+}
 
+// ////////////////////////////////////////////////////////////////////////////
+// statsPrintf / statsHistogram / statsLinks / statsFormat
+// ////////////////////////////////////////////////////////////////////////////
+// the metrics in the Prometheus text format, built only when asked for. The
+// buffer grows with the number of links; if it cannot, the scrape is cut
+// short and counted.
+// ////////////////////////////////////////////////////////////////////////////
 
-    // //////////////////////////////////////////////
-    // werte Eingabe vom pilight Daemon aus
-    // //////////////////////////////////////////////
+static char *statsBuffer;
+static int statsSize;
+static int statsLen;
+static unsigned long statsTruncated;   // scrapes that did not fit
 
-    json_t *SocketCom = NULL;
+void statsPrintf(const char *format, ...)
+{
+    va_list args;
+    int len;
 
-    
-    if (strchr(tcpString,'\n'))
+    va_start(args, format);
+    len = vsnprintf(statsBuffer + statsLen, statsSize - statsLen, format, args);
+    va_end(args);
+
+    if (statsLen + len >= statsSize)
     {
-        tokenizedString = strtok(tcpString,"\n");
-        while (tokenizedString != NULL)
-        {
-            printf("SOCKET: %s\n",tokenizedString);
-            
-            if ( (SocketCom = load_json(tokenizedString))     &&
-               ( json_typeof(SocketCom) == JSON_OBJECT) )
-            {
-                const char *key;
-                json_t *value;
-                json_t *myJson;
+        int size = statsSize * 2 > statsLen + len + 1 ? statsSize * 2 : statsLen + len + 1;
+        char *bigger = heapAlloc(size);
 
-                // ////////////////////////////////////////////////////////////
-                // The JSON object we have received from the pilight daemon
-                // is the status message which hopefully is "success"
-                // ////////////////////////////////////////////////////////////
+        if (!bigger)
+        {
+            printf("Error: stats cut short at %d bytes\n", statsLen);
+            statsTruncated++;
+            statsLen = statsSize ? statsSize - 1 : 0;
+            return;
+        }
+        memcpy(bigger, statsBuffer, statsLen);
+        heapFree(statsBuffer);
+        statsBuffer = bigger;
+        statsSize = size;
+
+        va_start(args, format);
+        len = vsnprintf(statsBuffer + statsLen, statsSize - statsLen, format, args);
+        va_end(args);
+    }
+    statsLen += len;
+}
 
-                if ( (myJson= json_object_get(SocketCom,"status")) && (json_is_string(myJson)) )
-                    pilightStatus=myJson;
+void statsHistogram(const char *name, const char *label, const char *value, struct histogram *h)
+{
+    unsigned long cumulative = 0;
+    int b;
 
-                // ////////////////////////////////////////////////////////////
-                // The JSON object we have received from the pilight daemon
-                // contains the initial values
-                // ////////////////////////////////////////////////////////////
+    for (b = 0; b < HISTOGRAM_BUCKETS - 1; b++)
+    {
+        cumulative += h->bucket[b];
+        statsPrintf("%s_bucket{%s=\"%s\",le=\"%.7g\"} %lu\n", name, label, value, (double) (1LL << b) / 1e6, cumulative);
+    }
+    statsPrintf("%s_bucket{%s=\"%s\",le=\"+Inf\"} %lu\n", name, label, value, h->count);
+    statsPrintf("%s_sum{%s=\"%s\"} %.6f\n", name, label, value, h->sum / 1e6);
+    statsPrintf("%s_count{%s=\"%s\"} %lu\n", name, label, value, h->count);
+}
 
-                if (myJson = json_object_get(SocketCom,"message"))
-                {
-                    if  ( (myJson = json_object_get(SocketCom,"values")) &&
-                          (json_is_array(myJson)) )
-                    {
-                            pilightConfig=myJson;
-                            int i;
-                            for(i = 0; i < json_array_size(myJson); i++)
-                            {
-                                json_t *data = json_array_get(myJson, i);
-                                handleDevice(data);
-                            }
-                    }
-                    
-                }
+void statsLinks()
+{
+    struct lineBuffer *lb[MAXSERVERS + MAXCONSOLES];
+    struct outQueue *q[MAXSERVERS + MAXCONSOLES];
+    int n = 0, i;
 
-                // ////////////////////////////////////////////////////////////
-                // The JSON object we have received from the pilight daemon
-                // contains an update - we need to check if it is about a device 
-                // that we monitor by cross-checking with the global settings
-                // ////////////////////////////////////////////////////////////
+    for (i = 0; i < serverCount; i++, n++)
+    {
+        lb[n] = &servers[i].input;
+        q[n] = &servers[i].queue;
+    }
+    for (i = 0; i < consoleCount; i++, n++)
+    {
+        lb[n] = &consoles[i].input;
+        q[n] = &consoles[i].queue;
+    }
 
-                if ( (myJson = json_object_get(SocketCom,"origin"))  &&
-                     (json_is_string(myJson))                        && 
-                     (strstr (json_string_value(myJson),"update")) )
-                {
-                    if ( (myJson = json_object_get(SocketCom,"devices")) &&
-                         (json_is_array(myJson)))
-                    {
-                        handleDevice(SocketCom);
-                    }
-                    
-                }
-                // if (SocketCom) json_decref(SocketCom); //new reference
-            }
+    // all samples of a metric go together, the links are the inner loop
 
-            // get the next line if any
-            tokenizedString=strtok(NULL,"\n");
-        }
-        
-        free (tcpString);
-        tcpString = (char *) malloc(1);
-        tcpString[0]='\0';
+    statsPrintf("# TYPE pilight_console_link_up gauge\n");
+    for (i = 0; i < n; i++)
+        statsPrintf("pilight_console_link_up{link=\"%s\"} %d\n", linkName(lb[i]), lb[i]->fd >= 0);
+    statsPrintf("# TYPE pilight_console_link_bytes_total counter\n");
+    for (i = 0; i < n; i++)
+    {
+        statsPrintf("pilight_console_link_bytes_total{link=\"%s\",direction=\"in\"} %lu\n", linkName(lb[i]), lb[i]->bytesIn);
+        statsPrintf("pilight_console_link_bytes_total{link=\"%s\",direction=\"out\"} %lu\n", linkName(lb[i]), q[i]->bytesOut);
     }
-    
+    statsPrintf("# TYPE pilight_console_link_lines_total counter\n");
+    for (i = 0; i < n; i++)
+    {
+        statsPrintf("pilight_console_link_lines_total{link=\"%s\",direction=\"in\"} %lu\n", linkName(lb[i]), lb[i]->linesIn);
+        statsPrintf("pilight_console_link_lines_total{link=\"%s\",direction=\"out\"} %lu\n", linkName(lb[i]), q[i]->linesOut);
+    }
+    statsPrintf("# TYPE pilight_console_link_overflows_total counter\n");
+    for (i = 0; i < n; i++)
+        statsPrintf("pilight_console_link_overflows_total{link=\"%s\"} %lu\n", linkName(lb[i]), __atomic_load_n(&lb[i]->overflows, __ATOMIC_RELAXED));
+    statsPrintf("# TYPE pilight_console_link_frame_errors_total counter\n");
+    for (i = 0; i < n; i++)
+        statsPrintf("pilight_console_link_frame_errors_total{link=\"%s\"} %lu\n", linkName(lb[i]), lb[i]->crcErrors);
+    statsPrintf("# TYPE pilight_console_queue_bytes gauge\n");
+    for (i = 0; i < n; i++)
+        statsPrintf("pilight_console_queue_bytes{link=\"%s\"} %d\n", linkName(lb[i]), q[i]->tail - q[i]->head);
+    statsPrintf("# TYPE pilight_console_queue_inflight_bytes gauge\n");
+    for (i = 0; i < n; i++)
+        statsPrintf("pilight_console_queue_inflight_bytes{link=\"%s\"} %d\n", linkName(lb[i]), q[i]->inFlight);
 }
 
+int statsFormat()
+{
+    int i;
+
+    statsLen = 0;
+    if (!statsBuffer)
+    {
+        statsBuffer = heapAlloc(STATSBUFFER_SIZE);
+        statsSize = statsBuffer ? STATSBUFFER_SIZE : 0;
+    }
+
+    statsPrintf("# HELP pilight_console_stage_seconds Time spent per processing stage.\n");
+    statsPrintf("# TYPE pilight_console_stage_seconds histogram\n");
+    for (i = 0; i < STAGES; i++)
+        statsHistogram("pilight_console_stage_seconds", "stage", stageNames[i], &stageTime[i]);
+
+    statsPrintf("# HELP pilight_console_latency_seconds From reading the input to writing what it caused.\n");
+    statsPrintf("# TYPE pilight_console_latency_seconds histogram\n");
+    for (i = 0; i < PATHS; i++)
+        statsHistogram("pilight_console_latency_seconds", "path", pathNames[i], &pathTime[i]);
+
+    statsLinks();
+
+    statsPrintf("# TYPE pilight_console_updates_total counter\n");
+    statsPrintf("pilight_console_updates_total %lu\n", __atomic_load_n(&updatesSeen, __ATOMIC_RELAXED));
+    statsPrintf("# TYPE pilight_console_updates_filtered_total counter\n");
+    statsPrintf("pilight_console_updates_filtered_total %lu\n", __atomic_load_n(&updatesFiltered, __ATOMIC_RELAXED));
+    statsPrintf("# TYPE pilight_console_parse_errors_total counter\n");
+    statsPrintf("pilight_console_parse_errors_total %lu\n", parseErrors);
+    statsPrintf("# TYPE pilight_console_control_rollbacks_total counter\n");
+    statsPrintf("pilight_console_control_rollbacks_total %lu\n", controlRollbacks);
+    statsPrintf("# TYPE pilight_console_heap_bytes gauge\n");
+    statsPrintf("pilight_console_heap_bytes %zu\n", __atomic_load_n(&heapLive, __ATOMIC_RELAXED));
+    statsPrintf("# TYPE pilight_console_arena_peak_bytes gauge\n");
+    statsPrintf("pilight_console_arena_peak_bytes %zu\n", arenaPeak);
+    statsPrintf("# TYPE pilight_console_stats_truncated_total counter\n");
+    statsPrintf("pilight_console_stats_truncated_total %lu\n", statsTruncated);
+
+    return statsLen;
+}
 
 // ////////////////////////////////////////////////////////////////////////////
-// readHandle
+// setupStats / statsClose / statsServe
 // ////////////////////////////////////////////////////////////////////////////
-// reads from a given File descriptor, tcp or serial
-// modifies global Strings serialString or tcpString
-// returns length read
+// the stats endpoint from the config, "stats" : 9100 listens on that port of
+// localhost, "stats" : "/run/pilight-console.stats" on a Unix socket. Every
+// connection gets one answer, as HTTP so that Prometheus can scrape it and
+// curl or nc can read it.
 // ////////////////////////////////////////////////////////////////////////////
 
-int readHandle (int fd)
+void setupStats()
 {
-    char buffer[BUFFER_SIZE];  // tcp    buffer
-    char *sOutput = (fd==serfd) ? serialString : tcpString;
-    int oSize = strlen(sOutput);
-    bzero(buffer, BUFFER_SIZE);
-    int rdlen;
-    rdlen = read(fd, buffer, BUFFER_SIZE - 2);
-    buffer[rdlen]='\0';
-    
-    if (rdlen > 0) 
-	{
-        sOutput = (char *) realloc(sOutput, rdlen + oSize + 1);
-        strncat(sOutput,buffer,rdlen);
-        if (fd==serfd) 
-            serialString =sOutput;
-        else 
-            tcpString = sOutput;
-     }
-     return(rdlen);
+    json_t *stats = json_object_get(globalConfig, "stats");
+    int on = 1;
+
+    if (json_is_integer(stats))
+    {
+        struct sockaddr_in addr;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(json_integer_value(stats));
+        statsFd = socket(AF_INET, SOCK_STREAM, 0);
+        setsockopt(statsFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(statsFd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        {
+            printf("Error: stats port %d: %s\n", (int) json_integer_value(stats), strerror(errno));
+            close(statsFd);
+            statsFd = -1;
+        }
+    }
+    else if (json_is_string(stats))
+    {
+        struct sockaddr_un addr;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, json_string_value(stats), sizeof(addr.sun_path) - 1);
+        unlink(addr.sun_path);
+        statsFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (bind(statsFd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        {
+            printf("Error: stats socket %s: %s\n", addr.sun_path, strerror(errno));
+            close(statsFd);
+            statsFd = -1;
+        }
+    }
+
+    if (statsFd >= 0)
+    {
+        listen(statsFd, 4);
+        fcntl(statsFd, F_SETFL, fcntl(statsFd, F_GETFL) | O_NONBLOCK);
+    }
+}
+
+// the scraper is served from the main loop like any other link: its
+// socket is non-blocking and in the poll set, first for the request and
+// then for as long as the answer takes to write. The next scraper waits in
+// the listen backlog meanwhile.
+
+static char statsRequest[512];
+static int statsRequestLen;
+static char statsHeader[128];
+static int statsHeaderLen;
+static int statsSent;                   // of header and metrics together
+
+void statsClose(void *arg)
+{
+    cancelTimer(statsClose, NULL);
+    close(statsClient);
+    statsClient = -1;
+}
+
+void statsServe()
+{
+    int len;
+
+    if (statsClient < 0)
+    {
+        if ((statsClient = accept(statsFd, NULL, NULL)) < 0)
+            return;
+        fcntl(statsClient, F_SETFL, fcntl(statsClient, F_GETFL) | O_NONBLOCK);
+        statsRequestLen = statsHeaderLen = statsSent = 0;
+        scheduleTimer(statsClose, NULL, STATS_TIMEOUT);
+        return;
+    }
+
+    // whatever is asked, the answer is the same. It is built once the
+    // request is complete.
+
+    if (!statsHeaderLen)
+    {
+        len = read(statsClient, statsRequest + statsRequestLen, sizeof(statsRequest) - 1 - statsRequestLen);
+        if ((len < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+            return;
+        if (len <= 0)
+        {
+            statsClose(NULL);
+            return;
+        }
+        statsRequestLen += len;
+        statsRequest[statsRequestLen] = '\0';
+        if (!strstr(statsRequest, "\r\n\r\n") && !strstr(statsRequest, "\n\n") &&
+            (statsRequestLen < sizeof(statsRequest) - 1))
+            return;
+
+        statsFormat();
+        statsHeaderLen = snprintf(statsHeader, sizeof(statsHeader), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: %d\r\n\r\n", statsLen);
+    }
+
+    // as much as the socket takes now, the rest when poll() says so
+
+    struct iovec iov[2];
+    int n = 0;
+
+    if (statsSent < statsHeaderLen)
+    {
+        iov[n].iov_base = statsHeader + statsSent;
+        iov[n++].iov_len = statsHeaderLen - statsSent;
+        iov[n].iov_base = statsBuffer;
+        iov[n++].iov_len = statsLen;
+    }
+    else
+    {
+        iov[n].iov_base = statsBuffer + statsSent - statsHeaderLen;
+        iov[n++].iov_len = statsLen - (statsSent - statsHeaderLen);
+    }
+    len = writev(statsClient, iov, n);
+    if ((len < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+        return;
+    if (len < 0)
+    {
+        statsClose(NULL);
+        return;
+    }
+    statsSent += len;
+    if (statsSent == statsHeaderLen + statsLen)
+        statsClose(NULL);
 }
 
 // ////////////////////////////////////////////////////////////////////////////
@@ -817,70 +4523,126 @@ int readHandle (int fd)
 int main( int argc, char *argv[] )  
 {
 	
-/*
-	if(argc < 3)
-	{
-		fprintf(stderr, "Usage: %s <SerialPort> <hostname>\n", argv[0]);
-		exit(1); 
-	}
-    
-    char *portname = argv[1];
-    char *hostname = argv[2];
-    
-*/
+    // command line options, all of them optional
+
+    char *configName = CONFIGFILE;
+    char *serverOption = NULL;      // host:port instead of the config
+    char *serialOption = NULL;      // serial port instead of the config
+    char *captureName = NULL;
+    char *traceName = NULL;
+    int foreground = 0;
+    int opt;
+
+    startedAt = nowMillis();
+
+    while ((opt = getopt(argc, argv, "f:p:s:c:t:vTF")) != -1)
+    {
+        switch (opt)
+        {
+            case 'f': configName = optarg; break;
+            case 'p': serverOption = optarg; break;
+            case 's': serialOption = optarg; break;
+            case 'c': captureName = optarg; break;
+            case 't': traceName = optarg; break;
+            case 'v': verbose = 1; break;
+            case 'T': threadedMode = 1; break;
+            case 'F': foreground = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-f config] [-p host:port] [-s serialport] [-c capturefile] [-t tracefile] [-v] [-T] [-F]\n", argv[0]);
+                exit(1);
+        }
+    }
 
     pid_t process_id = 0;
 
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    json_set_alloc_funcs(jsonAlloc, jsonFree);
+    if (pipe(signalPipe) < 0)
+    {
+        printf("Error creating pipe: %s\n", strerror(errno));
+        exit(1);
+    }
+    fcntl(signalPipe[0], F_SETFL, fcntl(signalPipe[0], F_GETFL) | O_NONBLOCK);
+    fcntl(signalPipe[1], F_SETFL, fcntl(signalPipe[1], F_GETFL) | O_NONBLOCK);
+    signal(SIGUSR1, onSigUsr1);
+    signal(SIGHUP, onSigHup);
+    signal(SIGPIPE, SIG_IGN);       // a lost connection shows up as EOF instead
+    srandom(getpid() ^ time(NULL));
+
+    if (captureName)
+    {
+        if (!(captureFile = fopen(captureName, "w")))
+        {
+            printf("Error opening %s: %s\n", captureName, strerror(errno));
+            exit(1);
+        }
+        captureStart = nowMicros();
+    }
 
-    readGlobalConfig();
+    readGlobalConfig(configName);
+    configPath = configName;
+    startupConfig = globalConfig;
     systemState=ST_NOALARM;
-	arduinoState=ST_OFFLINE;
+    setupConsoles(serialOption);
+    setupServers(serverOption);
 
-    json_t *pilightConfig = json_object_get(globalConfig,"pilight");
-    
-    const int portnumber   = json_integer_value(json_object_get(pilightConfig,"port"));
-    const char *hostname   = json_string_value(json_object_get(pilightConfig,"server"));
-    const char *portname   = json_string_value(json_object_get(globalConfig,"pinano"));
-    serialString = (char *) malloc(1);   serialString[0]='\0';
-    tcpString = (char *) malloc(1);      tcpString[0]='\0';
-		
-    printf ("pilight-console\n\nopening %s ...\n",portname);
-    serfd = open(portname, O_RDWR | O_NOCTTY | O_SYNC);
-    printf ("nopening %s:%d ...\n",hostname, portnumber);
-	tcpfd = socket_connect((char *) hostname, portnumber); 
-    printf("connected\n");
-	
-    if (serfd < 0) {
-        printf("Error opening %s: %s\n", portname, strerror(errno));
-        return -1;
+    int i;
+
+    for (i = 0; i < serverCount; i++)
+        if (!servers[i].host)
+        {
+            printf("Error: pilight server missing in %s\n", configName);
+            exit(1);
+        }
+    if (!consoles[0].port)
+    {
+        printf("Error: serial port missing in %s\n", configName);
+        exit(1);
     }
-	long save_fd = fcntl( serfd, F_GETFL );
-	save_fd |= O_NONBLOCK;
-	fcntl( serfd, F_SETFL, save_fd );
-	printf ("1\n");
-    set_interface_attribs(B57600,0);
-    printf("OK\nport open, waiting for Arduino...");
-    sleep(5); // wait for arduino to reset
-    printf("OK\n");
+		
+    for (i = 0; i < consoleCount; i++)
+        if (!consoles[i].port)
+        {
+            printf("Error: console %d has no port in %s\n", i + 1, configName);
+            exit(1);
+        }
+    setupStats();
 
-    sendCommand (serfd,"CLEAR\n");
-    sendCommand (serfd,"MESSAGE 1 0 0 pilight-console\n");
+    // -T or "threads" : true, every link is read and written on threads of
+    // its own, pilight connections are parsed there as well
 
-    const char *status;
-    int rdlen;
+    if (json_is_true(json_object_get(globalConfig, "threads")))
+        threadedMode = 1;
+    if (threadedMode)
+    {
+        if ((mainWake = eventfd(0, EFD_NONBLOCK)) < 0)
+        {
+            printf("Error creating eventfd: %s\n", strerror(errno));
+            exit(1);
+        }
+        for (i = 0; i < serverCount; i++)
+        {
+            servers[i].readerQueue = heapAlloc(sizeof(struct readerQueue));
+            memset(servers[i].readerQueue, 0, sizeof(struct readerQueue));
+            servers[i].threads = servers[i].queue.threads = linkThreadsCreate();
+        }
+        for (i = 0; i < consoleCount; i++)
+            consoles[i].threads = consoles[i].queue.threads = consoles[i].input.threads = linkThreadsCreate();
+    }
 
-    do 
+    if (!traceName && json_is_string(json_object_get(globalConfig, "trace")))
+        traceName = (char *) json_string_value(json_object_get(globalConfig, "trace"));
+    if (traceName)
     {
-        printf("Waiting for registration with Pilight\n");
-        sendCommand (tcpfd,"{\"action\": \"identify\", \"options\": { \"core\": 0, \"receiver\": 0, \"config\": 1, \"forward\": 0 }, \"uuid\": \"0000-d0-63-00-101010\", \"media\": \"all\" }\r\n");
-        rdlen = readHandle(tcpfd);
-        if ((rdlen > 0) && (strlen(tcpString) > 0))
-          parseStrings();
-        status = json_string_value(pilightStatus);
-    } while (!strstr(status,"success"));
+        traceOpen(traceName, json_integer_value(json_object_get(globalConfig, "tracerecords")));
+        traceDevices();
+    }
+		
+    printf ("pilight-console\n\n");
 
-    // Create child process
-    process_id = fork();
+    // Create child process (unless we stay in the foreground)
+    if (!foreground)
+        process_id = fork();
     // Indication of fork() failure
     if (process_id < 0)
     {
@@ -917,24 +4679,99 @@ int main( int argc, char *argv[] )
         /* write pid to lockfile */
         write(pidFilehandle, str, strlen(str));
         }
- 
-         
 
+    // bring up all links at once. Each console paints as soon as its sketch
+    // is READY, the device lines follow as soon as pilight sent the values.
 
+    for (i = 0; i < consoleCount; i++)
+    {
+        struct console *c = &consoles[i];
 
+        lcdClear(c);
+        lcdPrint(c, 1, 0, 0, "pilight-console");
+        c->lostAt = startedAt;
+        consoleOpen(c);
+    }
+    for (i = 0; i < serverCount; i++)
+        serverConnect(&servers[i]);
+    watchConfig();
 
-	sendCommand  (tcpfd,"{\"action\": \"request values\" }\r\n");
+    struct pollfd fds[MAXSERVERS + MAXCONSOLES + 4];
     
-    // main loop
+    // main loop - sleep in poll() until either side has something for us
+    // or a timer is due
     
     do 
 	{
+        int timeout;
+
+        if (reportRequested)
+            reportCounters();
+        if (reloadRequested)
+        {
+            reloadRequested = 0;
+            scheduleTimer(reloadConfig, NULL, 0);
+        }
+
+        timeout = runTimers();
+
+        // links that are down have fd -1 and are ignored by poll(). With
+        // -T the link threads wait on the descriptors, they wake the main
+        // loop through mainWake.
+
+        for (i = 0; i < serverCount; i++)
+        {
+            fds[i].fd = threadedMode ? -1 : servers[i].fd;
+            fds[i].events = POLLIN | (queueWritable(&servers[i].queue) ? POLLOUT : 0);
+        }
+        for (i = 0; i < consoleCount; i++)
+        {
+            lcdFlush(&consoles[i]);
+            fds[serverCount + i].fd = threadedMode ? -1 : consoles[i].fd;
+            fds[serverCount + i].events = POLLIN | (queueWritable(&consoles[i].queue) ? POLLOUT : 0);
+        }
+        fds[serverCount + consoleCount].fd = (statsClient >= 0) ? statsClient : statsFd;
+        fds[serverCount + consoleCount].events = ((statsClient >= 0) && statsHeaderLen) ? POLLOUT : POLLIN;
+        fds[serverCount + consoleCount + 1].fd = inotifyFd;
+        fds[serverCount + consoleCount + 1].events = POLLIN;
+        fds[serverCount + consoleCount + 2].fd = mainWake;
+        fds[serverCount + consoleCount + 2].events = POLLIN;
+        fds[serverCount + consoleCount + 3].fd = signalPipe[0];
+        fds[serverCount + consoleCount + 3].events = POLLIN;
+
+        if (poll(fds, serverCount + consoleCount + 4, timeout) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            printf("Error from poll: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        for (i = 0; i < serverCount; i++)
+            if (fds[i].revents & POLLOUT)
+                flushQueue(&servers[i].queue);
+        for (i = 0; i < consoleCount; i++)
+            if (fds[serverCount + i].revents & POLLOUT)
+                flushQueue(&consoles[i].queue);
+
+        for (i = 0; (i < serverCount) && !threadedMode; i++)
+            pollHandle(&fds[i], &servers[i].input, parseSocketLine);
+        if (fds[serverCount + consoleCount + 2].revents & POLLIN)
+            readerDrain();
+        if (fds[serverCount + consoleCount + 3].revents & POLLIN)
+        {
+            char drain[16];
+
+            while (read(signalPipe[0], drain, sizeof(drain)) > 0)
+                ;                   // the flags are looked at on the next round
+        }
+        for (i = 0; i < consoleCount; i++)
+            pollHandle(&fds[serverCount + i], &consoles[i].input, parseSerialLine);
 
-        rdlen = readHandle(serfd);
-        rdlen = readHandle(tcpfd);
-        if ((strlen(serialString) > 0) || (strlen(tcpString) > 0))
-          parseStrings();
-        waitabit();
+        if (fds[serverCount + consoleCount].revents)
+            statsServe();
+        if (fds[serverCount + consoleCount + 1].revents & POLLIN)
+            configChanged();
     } while (1);
 
 